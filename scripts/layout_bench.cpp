@@ -0,0 +1,99 @@
+//
+// Host benchmark of the runtime vs compile-time MCP layout.
+//
+// Runs the same role checks and index maths the firmware does for every
+// MCP scanned and output event, once reading the layout from globals (the
+// default build) and once with it fixed at compile time (FIXED_OUTPUT_START
+// and FIXED_OUTPUTS_PER_MCP).
+//
+//   g++ -O2 -std=gnu++17 scripts/layout_bench.cpp -o layout_bench && ./layout_bench
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+#define MCP_COUNT     8
+#define MCP_PIN_COUNT 16
+#define ITERATIONS    2000000
+
+// Runtime layout, set somewhere the compiler can't see (i.e. config)
+uint8_t g_mcp_output_start;
+uint8_t g_mcp_output_pins;
+
+__attribute__((noinline)) void jsonConfig(uint8_t start, uint8_t pins)
+{
+  g_mcp_output_start = start;
+  g_mcp_output_pins = pins;
+}
+
+// Same as the firmware
+template <uint8_t OUTPUT_START, uint8_t OUTPUT_PINS>
+struct FixedLayout
+{
+  static constexpr uint8_t outputStart() { return OUTPUT_START; }
+  static constexpr uint8_t outputPins() { return OUTPUT_PINS; }
+};
+
+struct RuntimeLayout
+{
+  static uint8_t outputStart() { return g_mcp_output_start; }
+  static uint8_t outputPins() { return g_mcp_output_pins; }
+};
+
+template <typename Layout>
+uint16_t getMinOutputIndex()
+{
+  return Layout::outputStart() * MCP_PIN_COUNT + 1;
+}
+
+template <typename Layout>
+uint32_t scan()
+{
+  uint32_t sum = 0;
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    // isInputMcp() for every MCP scanned
+    if (mcp < Layout::outputStart())
+    {
+      sum += mcp;
+      continue;
+    }
+
+    // Output index maths for an event on each pin, and back again
+    for (uint8_t pin = 0; pin < Layout::outputPins(); pin++)
+    {
+      uint16_t index = (mcp - Layout::outputStart()) * Layout::outputPins() + getMinOutputIndex<Layout>() + pin;
+      sum += (index - getMinOutputIndex<Layout>()) / Layout::outputPins() + Layout::outputStart();
+      sum += (index - getMinOutputIndex<Layout>()) % Layout::outputPins();
+    }
+  }
+  return sum;
+}
+
+template <typename Layout>
+double run(const char * name)
+{
+  volatile uint32_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < ITERATIONS; i++)
+  {
+    sink = sink + scan<Layout>();
+    // Stop the runtime layout being hoisted out of the loop, as it can't be
+    // in the firmware (the globals can change from any callback)
+    asm volatile("" ::: "memory");
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ITERATIONS;
+  printf("%-8s %8.1f ns/pass (checksum %u)\n", name, ns, (unsigned)sink);
+  return ns;
+}
+
+int main()
+{
+  jsonConfig(4, 16);
+
+  double runtime = run<RuntimeLayout>("runtime");
+  double fixed = run<FixedLayout<4, 16>>("fixed");
+  printf("fixed layout is %.1fx faster\n", runtime / fixed);
+  return 0;
+}
@@ -0,0 +1,174 @@
+//
+// Host benchmark of the status payload formats.
+//
+// Builds typical input and output events the same way the firmware does
+// (buildInputEvent()/buildOutputEvent()) and times ArduinoJson encoding
+// them as JSON (MQTT status payloads) and MessagePack ("msgpack" UDP
+// format), against packing the fixed size binary frame ("binary" UDP
+// format). Builds against the ArduinoJson PlatformIO fetched for the
+// firmware, so it measures the same serializers:
+//
+//   g++ -O2 -std=gnu++17 -I.pio/libdeps/rack32-debug/ArduinoJson/src scripts/payload_bench.cpp -o payload_bench && ./payload_bench
+//
+// Timings are for the host, use them to compare the formats rather than as
+// absolute ESP8266/ESP32 figures.
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <ArduinoJson.h>
+
+#define ITERATIONS    200000
+
+// Must match the frame layout in src/main.cpp
+#define UDP_FRAME_MAGIC   'S'
+#define UDP_FRAME_VERSION 2
+#define UDP_FRAME_SIZE    23
+
+struct event_t
+{
+  bool output;
+  uint16_t index;
+  uint8_t type;
+  uint8_t state;
+  uint32_t seq;
+  uint64_t timestamp;
+};
+
+const uint32_t BOOT_ID = 42;
+const uint64_t EPOCH_MS = 1760000000000ULL;
+
+// Same fields, and string handling (copied from stack buffers), as the
+// firmware
+void addEventTimestamp(JsonVariant json, uint64_t timestamp)
+{
+  json["timestamp"] = timestamp;
+  json["epochMs"] = EPOCH_MS;
+}
+
+void addEventSequence(JsonVariant json, const event_t & event)
+{
+  json["seq"] = event.seq;
+  json["boot"] = BOOT_ID;
+}
+
+void buildInputEvent(JsonVariant json, const event_t & event)
+{
+  uint16_t port = ((event.index - 1) / 4) + 1;
+  uint8_t channel = event.index - ((port - 1) * 4);
+
+  char inputType[9];
+  strcpy(inputType, "button");
+  char eventType[8];
+  strcpy(eventType, "single");
+
+  json["port"] = port;
+  json["channel"] = channel;
+  json["index"] = event.index;
+  json["type"] = inputType;
+  json["event"] = eventType;
+  addEventTimestamp(json, event.timestamp);
+  addEventSequence(json, event);
+}
+
+void buildOutputEvent(JsonVariant json, const event_t & event)
+{
+  char outputType[8];
+  strcpy(outputType, "relay");
+  char eventType[7];
+  strcpy(eventType, "on");
+
+  json["index"] = event.index;
+  json["type"] = outputType;
+  json["event"] = eventType;
+  addEventTimestamp(json, event.timestamp);
+  addEventSequence(json, event);
+}
+
+void putLittleEndian(uint8_t * buffer, uint64_t value, uint8_t bytes)
+{
+  for (uint8_t i = 0; i < bytes; i++)
+  {
+    buffer[i] = (value >> (i * 8)) & 0xFF;
+  }
+}
+
+size_t encodeJson(const event_t & event, uint8_t * buffer, size_t size)
+{
+  JsonDocument json;
+  event.output ? buildOutputEvent(json.as<JsonVariant>(), event) : buildInputEvent(json.as<JsonVariant>(), event);
+  return serializeJson(json, (char *)buffer, size);
+}
+
+size_t encodeMsgPack(const event_t & event, uint8_t * buffer, size_t size)
+{
+  JsonDocument json;
+  event.output ? buildOutputEvent(json.as<JsonVariant>(), event) : buildInputEvent(json.as<JsonVariant>(), event);
+  return serializeMsgPack(json, buffer, size);
+}
+
+size_t encodeBuildOnly(const event_t & event, uint8_t * buffer, size_t size)
+{
+  // Just the document, to separate the serializer cost from building it
+  JsonDocument json;
+  event.output ? buildOutputEvent(json.as<JsonVariant>(), event) : buildInputEvent(json.as<JsonVariant>(), event);
+  return json.size();
+}
+
+size_t encodeFrame(const event_t & event, uint8_t * buffer, size_t size)
+{
+  buffer[0] = UDP_FRAME_MAGIC;
+  buffer[1] = UDP_FRAME_VERSION;
+  buffer[2] = event.output ? 0x01 : 0x00;
+  buffer[3] = event.type;
+  buffer[4] = event.state;
+  putLittleEndian(&buffer[5], event.index, 2);
+  putLittleEndian(&buffer[7], event.seq, 4);
+  putLittleEndian(&buffer[11], BOOT_ID, 4);
+  putLittleEndian(&buffer[15], event.timestamp, 8);
+  return UDP_FRAME_SIZE;
+}
+
+void run(const char * name, const char * format, size_t (*encode)(const event_t &, uint8_t *, size_t), const event_t & event, bool payload)
+{
+  uint8_t buffer[256];
+  size_t bytes = encode(event, buffer, sizeof(buffer));
+
+  volatile size_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < ITERATIONS; i++)
+  {
+    sink = sink + encode(event, buffer, sizeof(buffer));
+    asm volatile("" ::: "memory");
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ITERATIONS;
+
+  if (payload)
+  {
+    printf("%-8s %-8s %8u %12.0f\n", name, format, (unsigned)bytes, ns);
+  }
+  else
+  {
+    printf("%-8s %-8s %8s %12.0f\n", name, format, "-", ns);
+  }
+}
+
+int main()
+{
+  event_t input = { false, 10, 0, 1, 123456, 123456789012ULL };
+  event_t output = { true, 65, 0, 1, 123457, 123456789012ULL };
+
+  printf("%-8s %-8s %8s %12s\n", "event", "format", "bytes", "ns/event");
+  for (const event_t * event : { &input, &output })
+  {
+    const char * name = event->output ? "output" : "input";
+    run(name, "build", encodeBuildOnly, *event, false);
+    run(name, "json", encodeJson, *event, true);
+    run(name, "msgpack", encodeMsgPack, *event, true);
+    run(name, "binary", encodeFrame, *event, true);
+  }
+  return 0;
+}
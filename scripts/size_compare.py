@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+#
+# Compare the flash and RAM usage of two PlatformIO environments.
+#
+# Builds each environment and parses the memory usage summary PlatformIO
+# prints at the end of a build. Defaults to comparing the headless Rack32
+# build against the standard Ethernet build.
+#
+#   python3 scripts/size_compare.py
+#   python3 scripts/size_compare.py --baseline rack32-eth_ESP32 --variant rack32-headless_ESP32
+#
+# Run by CI (.github/workflows/size.yml), which passes --summary to append a
+# markdown table to the job summary.
+#
+
+import argparse
+import re
+import subprocess
+import sys
+
+# e.g. "RAM:   [==        ]  15.2% (used 49812 bytes from 327680 bytes)"
+USAGE = re.compile(r"^(RAM|Flash):.*\(used (\d+) bytes from (\d+) bytes\)", re.MULTILINE)
+
+
+def build(env):
+    print("building %s..." % env, file=sys.stderr)
+    ret = subprocess.run(["pio", "run", "-e", env], stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    if ret.returncode != 0:
+        sys.stderr.write(ret.stdout)
+        sys.exit("build failed for %s" % env)
+
+    usage = {name: (int(used), int(total)) for name, used, total in USAGE.findall(ret.stdout)}
+    if "RAM" not in usage or "Flash" not in usage:
+        sys.exit("no memory usage summary found for %s" % env)
+    return usage
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare firmware sizes of two PlatformIO environments")
+    parser.add_argument("--baseline", default="rack32-eth_ESP32", help="environment to compare against")
+    parser.add_argument("--variant", default="rack32-headless_ESP32", help="environment to compare")
+    parser.add_argument("--summary", metavar="FILE", help="also append a markdown table to this file")
+    args = parser.parse_args()
+
+    baseline = build(args.baseline)
+    variant = build(args.variant)
+
+    rows = []
+    print("%-6s %12s %12s %10s" % ("", args.baseline[:12], args.variant[:12], "change"))
+    for name in ("Flash", "RAM"):
+        before, total = baseline[name]
+        after, _ = variant[name]
+        rows.append((name, before, after, after - before, 100.0 * (after - before) / total, total))
+        print("%-6s %12d %12d %+10d (%+.1f%% of %d)" % rows[-1])
+
+    if args.summary:
+        with open(args.summary, "a") as summary:
+            summary.write("| | %s | %s | change |\n|---|---:|---:|---:|\n" % (args.baseline, args.variant))
+            for row in rows:
+                summary.write("| %s | %d | %d | %+d (%+.1f%% of %d) |\n" % row)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+#
+# Listener for the StateIO UDP multicast event stream.
+#
+# Decodes the binary event frames sent when the "udpMulticast" config option
+# is set, printing each event and reporting sequence gaps. Run with --bench
+# to send frames to ourselves over loopback and measure delivery latency.
+#
+#   python3 scripts/udp_listener.py --group 239.1.2.3 --port 5005
+#   python3 scripts/udp_listener.py --group 239.1.2.3 --port 5005 --bench 10000
+#
+
+import argparse
+import socket
+import struct
+import threading
+import time
+
+# Must match the frame layout in src/main.cpp
+FRAME = struct.Struct("<cBBBBHIIQ")
+FRAME_MAGIC = b"S"
+FRAME_VERSION = 2
+
+
+def open_socket(group, port, interface):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", port))
+    mreq = socket.inet_aton(group) + socket.inet_aton(interface)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+    return sock
+
+
+def decode(data):
+    if len(data) != FRAME.size:
+        return None
+    magic, version, flags, type, state, index, seq, boot, timestamp = FRAME.unpack(data)
+    if magic != FRAME_MAGIC or version != FRAME_VERSION:
+        return None
+    return {
+        "output": bool(flags & 0x01),
+        "type": type,
+        "state": state,
+        "index": index,
+        "seq": seq,
+        "boot": boot,
+        "timestamp": timestamp,
+    }
+
+
+def listen(args):
+    sock = open_socket(args.group, args.port, args.interface)
+    last_seq = {}
+    print("listening on %s:%d..." % (args.group, args.port))
+    while True:
+        data, (host, _) = sock.recvfrom(64)
+        event = decode(data)
+        if event is None:
+            print("%s: invalid frame (%d bytes)" % (host, len(data)))
+            continue
+
+        # Sequence numbers restart at 1 when a device reboots (with a new boot id)
+        seq = event["seq"]
+        boot = event["boot"]
+        previous = last_seq.get(host)
+        if previous is not None and previous[0] != boot:
+            print("%s: rebooted (boot %d -> %d)" % (host, previous[0], boot))
+        elif previous is not None and seq > previous[1] + 1:
+            print("%s: missed %d event(s) %d-%d" % (host, seq - previous[1] - 1, previous[1] + 1, seq - 1))
+        last_seq[host] = (boot, seq)
+
+        print("%s: boot=%d seq=%d t=%.6fs %s index=%d type=%d state=%d" % (
+            host, boot, seq, event["timestamp"] / 1e6,
+            "output" if event["output"] else "input",
+            event["index"], event["type"], event["state"]))
+
+
+def bench(args):
+    # Send frames carrying our own send time and time how long they take to
+    # come back via the multicast loopback
+    sock = open_socket(args.group, args.port, args.interface)
+    sock.settimeout(1.0)
+
+    tx = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    tx.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP, 1)
+    tx.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF, socket.inet_aton(args.interface))
+
+    latencies = []
+
+    def receive():
+        while len(latencies) < args.bench:
+            try:
+                data, _ = sock.recvfrom(64)
+            except socket.timeout:
+                return
+            event = decode(data)
+            if event is not None:
+                latencies.append(time.perf_counter_ns() // 1000 - event["timestamp"])
+
+    receiver = threading.Thread(target=receive)
+    receiver.start()
+
+    for seq in range(1, args.bench + 1):
+        now = time.perf_counter_ns() // 1000
+        tx.sendto(FRAME.pack(FRAME_MAGIC, FRAME_VERSION, 0, 0, 0, 1, seq, 1, now), (args.group, args.port))
+        time.sleep(args.interval)
+
+    receiver.join()
+
+    if not latencies:
+        print("no frames received")
+        return
+
+    latencies.sort()
+    count = len(latencies)
+    print("received %d/%d frames" % (count, args.bench))
+    print("latency us: min=%d p50=%d p99=%d max=%d" % (
+        latencies[0], latencies[count // 2], latencies[min(count - 1, count * 99 // 100)], latencies[-1]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="StateIO UDP multicast event stream listener")
+    parser.add_argument("--group", default="239.1.2.3", help="multicast group")
+    parser.add_argument("--port", type=int, default=5005, help="UDP port")
+    parser.add_argument("--interface", default="0.0.0.0", help="local interface address")
+    parser.add_argument("--bench", type=int, metavar="N", help="send N frames over loopback and report latency")
+    parser.add_argument("--interval", type=float, default=0.0005, help="seconds between bench frames")
+    args = parser.parse_args()
+
+    if args.bench:
+        if args.interface == "0.0.0.0":
+            args.interface = "127.0.0.1"
+        bench(args)
+    else:
+        listen(args)
+
+
+if __name__ == "__main__":
+    main()
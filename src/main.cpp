@@ -16,13 +16,36 @@
 
 /*--------------------------- Libraries ----------------------------------*/
 #include <Arduino.h>
-#include <Adafruit_MCP23X17.h>        // For MCP23017 I/O buffers
+#include <Wire.h>                     // For MCP23017 I/O buffers
 #include <OXRS_Input.h>               // For input handling
 #include <OXRS_Output.h>              // For output handling
-#if defined(OXRS_RACK32)
+#include <time.h>                     // For event wall clock timestamps
+#include <EEPROM.h>                   // For persisting output state
+#include <new>                        // For placement new of the I/O handlers
+#if defined(WIFI_MODE)
+#if defined(ESP8266)
+#include <ESP8266WiFi.h>              // For our IP when joining multicast groups
+#endif
+#include <WiFiUdp.h>                  // For UDP multicast event stream
+#else
+#include <Ethernet.h>
+#include <EthernetUdp.h>              // For UDP multicast event stream
+#include <Dns.h>                      // For resolving our NTP server
+#endif
+#if defined(ESP32)
+#include <esp_timer.h>                // For 64-bit event timestamps
+#include <esp_heap_caps.h>            // For counting failed heap allocations
+#endif
+// Rack32s without a screen can be built headless, with all our display
+// code and the embedded logo compiled out
+#if defined(OXRS_RACK32) && defined(OXRS_HEADLESS)
+#include <OXRS_Rack32.h> // Rack32 support (no screen)
+OXRS_Rack32 oxrs;
+#elif defined(OXRS_RACK32)
 #include <OXRS_Rack32.h> // Rack32 support
 #include "logo.h"        // Embedded maker logo
 OXRS_Rack32 oxrs(FW_LOGO);
+#define LCD_ENABLED
 #elif defined(OXRS_ROOM8266)
 #include <OXRS_Room8266.h> // Room8266 support
 OXRS_Room8266 oxrs;
@@ -31,31 +54,675 @@ OXRS_Room8266 oxrs;
 // Serial
 #define       SERIAL_BAUD_RATE      115200
 
-// Can have up to 8x MCP23017s on a single I2C bus
+// Can have up to 8x MCP23017s on a single I2C bus, or up to 8x on each
+// channel of a TCA9548A I2C multiplexer (define I2C_MUX_ADDRESS to enable)
+#if defined(I2C_MUX_ADDRESS)
+// Channel -> MCP address map, one entry per MCP slot, override both lists
+// via build flags to match your installation (max 32 slots). Defaults to
+// two fully populated mux channels.
+#if !defined(MCP_I2C_CHANNELS)
+#define       MCP_I2C_CHANNELS      0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1
+#define       MCP_I2C_ADDRESSES     0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27
+#endif
+const uint8_t MCP_I2C_CHANNEL[]     = { MCP_I2C_CHANNELS };
+const byte    MCP_I2C_ADDRESS[]     = { MCP_I2C_ADDRESSES };
+static_assert(sizeof(MCP_I2C_CHANNEL) == sizeof(MCP_I2C_ADDRESS), "MCP_I2C_CHANNELS and MCP_I2C_ADDRESSES must be the same length");
+
+// Marker used when no mux channel is known to be selected
+#define       I2C_MUX_NO_CHANNEL    0xFF
+#else
 const byte    MCP_I2C_ADDRESS[]     = { 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27 };
+#endif
 const uint8_t MCP_COUNT             = sizeof(MCP_I2C_ADDRESS);
+static_assert(MCP_COUNT <= 32, "g_mcps_found can only track up to 32 MCPs");
 
 // Each MCP23017 has 16 I/O pins
 #define       MCP_PIN_COUNT         16
 
-// Set false for breakout boards with external pull-ups
+// Set false for breakout boards with external pull-ups (default, can be
+// overridden via the "internalPullups" config option or per input)
+#if !defined(MCP_INTERNAL_PULLUPS)
 #define       MCP_INTERNAL_PULLUPS  true
+#endif
 
-// Speed up the I2C bus to get faster event handling
+// MCP23017 registers (IOCON.BANK = 0, so port A/B registers are paired
+// and sequential operation lets us burst write adjacent registers)
+#define       MCP_REG_IODIR         0x00
+#define       MCP_REG_IPOL          0x02
+#define       MCP_REG_GPPU          0x0C
+#define       MCP_REG_GPIO          0x12
+#define       MCP_REG_OLAT          0x14
+
+// Speed up the I2C bus to get faster event handling (default, can be
+// overridden via the "i2cClockSpeed" config option)
+#if !defined(I2C_CLOCK_SPEED)
 #define       I2C_CLOCK_SPEED       400000L
+#endif
+
+// Supported I2C clock speeds, fastest first - we step down through these
+// at startup and at runtime until the bus is error free (the MCP23017 is
+// good for 1.7MHz, but not all platforms or cable runs will be, and the
+// TCA9548A mux is only rated for 400kHz)
+#if defined(I2C_MUX_ADDRESS)
+const uint32_t I2C_CLOCK_STEPS[]    = { 400000L, 100000L };
+#else
+const uint32_t I2C_CLOCK_STEPS[]    = { 1700000L, 1000000L, 400000L, 100000L };
+#endif
+const uint8_t I2C_CLOCK_STEP_COUNT  = sizeof(I2C_CLOCK_STEPS) / sizeof(uint32_t);
+
+// Number of reads from each MCP used to calibrate the I2C clock speed
+#define       I2C_CALIBRATION_READS 16
+
+// Step the I2C clock down if the error rate over a monitoring window exceeds
+// this threshold (errors per 1000 transactions, with a minimum error count
+// so a single glitch or unplugged MCP doesn't slow the bus)
+#define       I2C_MONITOR_MS        10000
+#define       I2C_ERROR_PERMILLE    1
+#define       I2C_ERROR_MIN_COUNT   3
+
+// Try stepping the I2C clock back up (to no faster than calibrated at boot)
+// after this many consecutive error free monitoring windows
+#define       I2C_STEP_UP_WINDOWS   30
+
+// Retry a failed GPIO read before taking an MCP offline, and back off from
+// re-probing an MCP which keeps failing (doubling the interval each time, up
+// to 2^I2C_BACKOFF_MAX_SHIFT re-probe intervals)
+#define       I2C_READ_RETRIES      1
+#define       I2C_BACKOFF_MAX_SHIFT 6
+
+// Wall clock is only added to event timestamps once it has been set (i.e.
+// via NTP), anything before 2020-01-01 means it hasn't
+#define       MIN_VALID_EPOCH       1577836800L
+
+// Ethernet builds sync the clock over their own UDP socket, the SNTP client
+// in the core only runs over WiFi - every hour once synced, or every minute
+// until then
+#define       NTP_PORT              123
+#define       NTP_LOCAL_PORT        8123
+#define       NTP_PACKET_SIZE       48
+#define       NTP_EPOCH_OFFSET      2208988800UL  // 1900 -> 1970
+#define       NTP_TIMEOUT_MS        2000
+#define       NTP_DNS_TIMEOUT_MS    1000
+#define       NTP_SYNC_MS           3600000L
+#define       NTP_RETRY_MS          60000L
+
+// Number of recent events kept in memory so they can be replayed on request
+#if defined(OXRS_ROOM8266)
+#define       EVENT_RING_SIZE       64
+#else
+#define       EVENT_RING_SIZE       256
+#endif
+
+// Events are queued in priority lanes and published in strict priority
+// order, so high priority events (e.g. security alarms) never wait behind
+// a backlog of normal priority events (e.g. rotary steps)
+#define       EVENT_PRIORITY_HIGH   0
+#define       EVENT_PRIORITY_NORMAL 1
+#define       EVENT_PRIORITY_COUNT  2
+
+// Max events queued in each priority lane
+#if defined(OXRS_ROOM8266)
+#define       EVENT_QUEUE_SIZE      16
+#else
+#define       EVENT_QUEUE_SIZE      32
+#endif
+
+// Max normal priority events published per loop, so we get back to sampling
+// inputs (and any high priority events they raise) promptly
+#define       EVENT_NORMAL_BUDGET   8
+
+// Max retained per-index state topics published per loop
+#define       RETAINED_STATE_BUDGET 8
+
+// Max replayed events published per loop, and only once the priority lanes
+// are empty, so a replay never holds up live events
+#define       REPLAY_BUDGET         8
+
+// Binary event frames sent to the optional UDP multicast group - all values
+// little-endian, type/state are the raw OXRS_Input/OXRS_Output constants
+//   [0]     magic 'S'
+//   [1]     frame version
+//   [2]     flags (bit 0 = output event)
+//   [3]     type
+//   [4]     state
+//   [5-6]   index
+//   [7-10]  sequence number
+//   [11-14] boot id
+//   [15-22] timestamp (microseconds since boot)
+#define       UDP_FRAME_MAGIC       'S'
+#define       UDP_FRAME_VERSION     2
+#define       UDP_FRAME_SIZE        23
+
+// Alternatively events can be sent as MessagePack, using the same schema as
+// the JSON status payloads, and MessagePack commands/config received (see
+// the "udpMulticast" config option)
+#define       UDP_FORMAT_FRAME      0
+#define       UDP_FORMAT_MSGPACK    1
+#define       UDP_MSGPACK_SIZE      256
+#define       UDP_COMMAND_SIZE      512
+
+// Max packets discarded per loop when not accepting UDP commands (so frames
+// from other nodes never pile up in the socket)
+#define       UDP_DISCARD_MAX       8
+
+// Output states can be persisted (per output) and restored at boot, but are
+// only written once they have been stable for a while, and within a write
+// budget (a burst, then one per refill) to spare the flash - every commit
+// erases the whole 4KB EEPROM sector on the ESP8266 (rated ~100k erases),
+// so output state alone is capped at 24 + 4 erases a day (~10 years). The
+// sector is shared with the boot counter, which costs an erase every boot
+// (a unit stuck in a reboot loop wears it out in 100k boots), and the I2C
+// topology and config cache, which cost one whenever they change
+#define       OUTPUT_STORE_MAGIC    0x53544F31  // "STO1"
+#define       OUTPUT_STORE_DELAY_MS 5000
+#define       OUTPUT_STORE_BURST    4
+#define       OUTPUT_STORE_REFILL_MS  3600000L
+
+// Where a config came from - only full configs from the hardware library are
+// stashed and cached, not replays of either or partial configs sent via UDP
+#define       CONFIG_FROM_OXRS      0
+#define       CONFIG_FROM_CACHE     1
+#define       CONFIG_FROM_UDP       2
+#define       CONFIG_FROM_STASH     3
+
+// The I/O related config is cached (as MessagePack) after the output store,
+// so it can be applied at boot before the network (and full config) is up
+#define       CONFIG_CACHE_MAGIC    0x53544331  // "STC1"
+#define       CONFIG_CACHE_ADDRESS  sizeof(output_store_t)
+#if defined(OXRS_ROOM8266)
+#define       CONFIG_CACHE_SIZE     2048
+#else
+#define       CONFIG_CACHE_SIZE     3072
+#endif
+
+// The MCPs found last boot are cached so we only need to verify them, not
+// probe every address, unless something has changed
+#define       TOPOLOGY_MAGIC        0x53545431  // "STT1"
+#define       TOPOLOGY_ADDRESS      (CONFIG_CACHE_ADDRESS + sizeof(config_cache_header_t) + CONFIG_CACHE_SIZE)
+
+// Boot counter, sent with every event so consumers can tell a reboot (and
+// the sequence numbers restarting) from lost events
+#define       BOOT_COUNT_MAGIC      0x53544231  // "STB1"
+#define       BOOT_COUNT_ADDRESS    (TOPOLOGY_ADDRESS + sizeof(topology_t))
+
+#define       EEPROM_SIZE           (BOOT_COUNT_ADDRESS + sizeof(boot_count_t))
+
+// Fixed arenas for the JsonDocuments we build over and over (events, and
+// schemas/telemetry), so they don't churn and fragment the heap. Every
+// document takes at least one 1KB ArduinoJson pool (plus our 8 byte block
+// header) and its copied strings, and a UDP command document is still alive
+// while the events it triggers are published, so the event arena holds two
+// documents with room to spare (~2.3KB for a replay or outputs command)
+#if !defined(EVENT_ARENA_SIZE)
+#define       EVENT_ARENA_SIZE      3072
+#endif
+
+// Config/command schemas and telemetry are only built at boot and then every
+// TELEMETRY_INTERVAL_MS, so on the Room8266 this arena is taken from the heap
+// while in use rather than held in RAM for good. Both sizes can be overridden
+// via build flags, to tune them to the peaks reported in the telemetry.
+#if !defined(SCHEMA_ARENA_SIZE)
+#if defined(OXRS_ROOM8266)
+#define       SCHEMA_ARENA_SIZE     6144
+#else
+#define       SCHEMA_ARENA_SIZE     8192
+#endif
+#endif
+
+// How often to sample the heap and loop stack, and the levels at which we
+// raise an alert (cleared again once back above the level + hysteresis)
+#define       HEALTH_SAMPLE_MS      1000
+#if defined(OXRS_ROOM8266)
+#define       HEAP_FREE_ALERT       6144
+#define       HEAP_BLOCK_ALERT      2048
+#define       STACK_FREE_ALERT      512
+#define       HEAP_FRAG_ALERT       50
+#else
+#define       HEAP_FREE_ALERT       16384
+#define       HEAP_BLOCK_ALERT      4096
+#define       STACK_FREE_ALERT      1024
+#endif
+#define       HEALTH_HYSTERESIS_PC  10
+
+// How often to publish a summary of events suppressed by input rate limits
+#define       CHATTER_SUMMARY_MS    1000
+
+// How often to publish telemetry
+#define       TELEMETRY_INTERVAL_MS 60000
+
+// How often to re-probe for missing MCPs and check the others are still configured
+#define       I2C_REPROBE_MS        5000
+
+// How long to suppress input events after an MCP is (re)initialised
+#define       MCP_SETTLE_MS         250
 
 // Internal constant used when input type parsing fails
 #define       INVALID_INPUT_TYPE    99
 
+// Input event filtering (bit per input event, see INPUT_EVENT_NAMES)
+#define       INPUT_EVENT_COUNT     20
+#define       INVALID_INPUT_EVENT   99
+#define       INPUT_EVENT_FILTER_SET  0x80000000
+
 // Internal constants used when output type parsing fails
 #define       INVALID_OUTPUT_TYPE   99
+
+// The port display can only show the first 8 MCPs
+#if defined(LCD_ENABLED)
+#define       LCD_MCP_COUNT         8
+
+// Port animations are only redrawn when a port value changes, and changes
+// are coalesced so we redraw at most this often (configurable)
+#define       LCD_REFRESH_MS        50
+
+// Port animations are rendered by a separate task on the protocol core, so
+// SPI display work never delays the main loop (which runs on the app core)
+#define       LCD_TASK_STACK        4096
+#define       LCD_TASK_PRIORITY     1
+#define       LCD_TASK_CORE         0
+
+// The hardware library's loop draws to the display too (its MQTT and link
+// LEDs), so rather than wait for a render it is skipped for that pass - but
+// never put off for longer than this, so the network isn't starved
+#define       LCD_DEFER_MAX_MS      100
+#endif
+/*--------------------------- Data Types ---------------------------------*/
+// Heap/stack health alerts, one bit each in g_health_alerts
+enum healthAlert_t { HEALTH_ALERT_HEAP_FREE, HEALTH_ALERT_HEAP_BLOCK, HEALTH_ALERT_HEAP_FRAG, HEALTH_ALERT_STACK_FREE, HEALTH_ALERT_COUNT };
+
+// Bump allocator for JsonDocuments over a fixed buffer. The most recent
+// block can grow/shrink in place and the whole arena is reclaimed once
+// everything has been freed. If the arena is full we fall back to the heap
+// (counted as an overflow) rather than truncating the document. Without a
+// buffer the arena takes one from the heap on first use, and gives it back
+// once everything has been freed (for documents we only build now and then).
+class JsonArena : public ArduinoJson::Allocator
+{
+public:
+  JsonArena(uint8_t * buffer, size_t size) : _buffer(buffer), _size(size) {}
+  JsonArena(size_t size) : _buffer(NULL), _size(size), _transient(true) {}
+
+  void * allocate(size_t size) override
+  {
+    if (!_buffer)
+    {
+      _buffer = (uint8_t *)malloc(_size);
+      if (!_buffer)
+      {
+        _overflows++;
+        return heapAllocate(size);
+      }
+    }
+
+    size_t needed = HEADER + align(size);
+    if (_used + needed > _size)
+    {
+      _overflows++;
+      return heapAllocate(size);
+    }
+
+    uint8_t * block = _buffer + _used;
+    *(size_t *)block = align(size);
+    _used += needed;
+    _live++;
+    if (_used > _peak) { _peak = _used; }
+    return block + HEADER;
+  }
+
+  void deallocate(void * ptr) override
+  {
+    if (!ptr)
+      return;
+
+    if (!owns(ptr))
+    {
+      free(ptr);
+      return;
+    }
+
+    if (--_live == 0)
+    {
+      _used = 0;
+      if (_transient)
+      {
+        free(_buffer);
+        _buffer = NULL;
+      }
+    }
+    else if (isLast(ptr))
+    {
+      _used = (uint8_t *)ptr - HEADER - _buffer;
+    }
+  }
+
+  void * reallocate(void * ptr, size_t size) override
+  {
+    if (!ptr)
+      return allocate(size);
+
+    if (!owns(ptr))
+    {
+      void * moved = realloc(ptr, size);
+      if (!moved) { _failures++; }
+      return moved;
+    }
+
+    size_t * blockSize = (size_t *)((uint8_t *)ptr - HEADER);
+    size_t offset = (uint8_t *)ptr - _buffer;
+
+    // Grow/shrink the last block in place if there is room
+    if (isLast(ptr) && offset + align(size) <= _size)
+    {
+      *blockSize = align(size);
+      _used = offset + *blockSize;
+      if (_used > _peak) { _peak = _used; }
+      return ptr;
+    }
+
+    if (align(size) <= *blockSize)
+      return ptr;
+
+    void * moved = allocate(size);
+    if (moved)
+    {
+      memcpy(moved, ptr, *blockSize);
+      deallocate(ptr);
+    }
+    return moved;
+  }
+
+  size_t size() const { return _size; }
+  size_t peak() const { return _peak; }
+  uint32_t overflows() const { return _overflows; }
+  uint32_t failures() const { return _failures; }
+
+private:
+  static const size_t HEADER = 8;
+
+  void * heapAllocate(size_t size)
+  {
+    void * ptr = malloc(size);
+    if (!ptr) { _failures++; }
+    return ptr;
+  }
+
+  static size_t align(size_t size) { return (size + 7) & ~(size_t)7; }
+
+  bool owns(void * ptr) const { return _buffer && ptr >= _buffer && ptr < _buffer + _size; }
+  bool isLast(void * ptr) const { return (uint8_t *)ptr + *(size_t *)((uint8_t *)ptr - HEADER) == _buffer + _used; }
+
+  uint8_t * _buffer;
+  size_t _size;
+  bool _transient = false;
+  size_t _used = 0;
+  size_t _peak = 0;
+  uint16_t _live = 0;
+  uint32_t _overflows = 0;
+  uint32_t _failures = 0;
+};
+
+// Storage for the I/O handler of a single MCP (input or output)
+#define       HANDLER_SIZE          (sizeof(OXRS_Input) > sizeof(OXRS_Output) ? sizeof(OXRS_Input) : sizeof(OXRS_Output))
+typedef struct
+{
+  alignas(OXRS_Input) alignas(OXRS_Output) uint8_t data[HANDLER_SIZE];
+} handler_slot_t;
+
+// An input or output event, as published
+typedef struct
+{
+  uint32_t seq;
+  uint64_t timestamp;
+  uint16_t index;
+  uint8_t type;
+  uint8_t state;
+  bool output;
+  uint16_t suppressed;
+} event_t;
+
+// Queue of events waiting to be published
+typedef struct
+{
+  event_t events[EVENT_QUEUE_SIZE];
+  uint8_t head;
+  uint8_t count;
+  uint8_t maxCount;
+  uint32_t overflows;
+} event_queue_t;
+
+// Token bucket used to rate limit the events from a single input
+typedef struct
+{
+  uint32_t refillMs;
+  uint32_t lastUs;
+  uint16_t suppressed;
+  uint8_t rate;
+  uint8_t tokens;
+  uint8_t lastType;
+  uint8_t lastState;
+  bool chattering;
+  bool recent;
+} rate_limit_t;
+
+// Current state of a bi-stable input or output, for its retained topic
+typedef struct
+{
+  uint64_t timestamp;
+  uint8_t type;
+  uint8_t state;
+  bool dirty;
+} retained_state_t;
+
+// Persisted output state, along with the layout it was saved with
+typedef struct
+{
+  uint32_t magic;
+  uint8_t outputStart;
+  uint8_t outputPins;
+  uint16_t olat[MCP_COUNT];
+  uint16_t persist[MCP_COUNT];
+  uint32_t checksum;
+} output_store_t;
+
+// Header for the cached config (followed by the MessagePack data)
+typedef struct
+{
+  uint32_t magic;
+  uint16_t length;
+  uint32_t checksum;
+} config_cache_header_t;
+
+// Cached I2C topology (bitmask of MCPs found)
+typedef struct
+{
+  uint32_t magic;
+  uint32_t mcps;
+  uint32_t check;
+} topology_t;
+
+// Persisted boot counter
+typedef struct
+{
+  uint32_t magic;
+  uint32_t count;
+  uint32_t check;
+} boot_count_t;
+
+// Per-MCP I2C bus statistics (bytes are the register address and data,
+// excluding the I2C address byte)
+typedef struct
+{
+  uint32_t transactions;
+  uint32_t bytes;
+  uint32_t errors;
+  uint32_t retries;
+  uint64_t busUs;
+} i2c_stats_t;
 /*--------------------------- Global Variables ---------------------------*/
 // Each bit corresponds to an MCP found on the IC2 bus
-uint8_t g_mcps_found = 0;
+uint32_t g_mcps_found = 0;
+
+// Each bit corresponds to an MCP currently responding and configured
+uint32_t g_mcps_online = 0;
+
+// Each bit corresponds to an MCP whose input events are suppressed until
+// it has settled after being (re)initialised
+uint32_t g_mcps_untrusted = 0;
+uint32_t g_mcp_settle_ms[MCP_COUNT];
+
+// Each bit corresponds to an MCP re-initialised after going offline, whose
+// input states are published once it has settled
+uint32_t g_mcps_requery = 0;
+
+// Last value written to the output latch of each MCP (restored on re-init)
+uint16_t g_mcp_olat[MCP_COUNT];
+
+// Outputs whose state is persisted and restored at boot, and whether any
+// of them have changed since we last saved
+uint16_t g_mcp_persist[MCP_COUNT];
+bool g_output_store_dirty = false;
+uint32_t g_output_store_changed_ms = 0;
+uint32_t g_output_store_writes = 0;
+uint8_t g_output_store_tokens = OUTPUT_STORE_BURST;
+uint32_t g_output_store_refill_ms = 0;
+
+// Where the config currently being applied came from
+uint8_t g_config_source = CONFIG_FROM_OXRS;
+
+// Set once we hand over to the hardware library, which starts the display
+// and logging before calling back with any config or commands
+bool g_oxrs_ready = false;
+
+// Input polarity and pull-up config of each MCP, applied in hardware so the
+// GPIO values we read already reflect any inverted inputs
+uint16_t g_mcp_ipol[MCP_COUNT];
+uint16_t g_mcp_gppu[MCP_COUNT];
+
+// Time (microseconds since boot) the GPIO values were last read from each
+// MCP, so events are timestamped when they were sampled not published
+uint64_t g_mcp_sample_us[MCP_COUNT];
+
+// Sequence number of the last event published (never reset, so consumers
+// can detect gaps across MQTT reconnects), and a ring of recent events
+uint32_t g_event_seq = 0;
+
+// Incremented (and persisted) every boot, sequence numbers are per boot
+uint32_t g_boot_id = 0;
+event_t g_event_ring[EVENT_RING_SIZE];
+
+// Range of sequence numbers still to be replayed (none if from is 0)
+uint32_t g_replay_from = 0;
+uint32_t g_replay_to = 0;
+
+// Priority event lanes, and which input types are high priority (bitmask
+// of input types, security by default)
+event_queue_t g_event_queue[EVENT_PRIORITY_COUNT];
+uint16_t g_priority_input_types = (1 << SECURITY);
+
+// Retained per-index state topics (if enabled) - the current state of each
+// index (only allocated once first enabled), which are waiting to be
+// published, whether to (re)seed them and whether we are in the middle of
+// doing so
+bool g_retained_state = false;
+retained_state_t * g_retained_state_image = NULL;
+uint16_t g_retained_state_pending = 0;
+bool g_retained_state_seed = false;
+bool g_retained_state_seeding = false;
+
+// Input events to drop before publishing, per input type and per input
+// (indexed by input index - 1, only used if INPUT_EVENT_FILTER_SET)
+uint32_t g_input_type_event_filter[16];
+uint32_t g_input_event_filter[MCP_COUNT * MCP_PIN_COUNT];
+uint32_t g_input_events_filtered = 0;
+
+// Per input rate limits (indexed by input index - 1, only allocated once an
+// input has a rate limit)
+rate_limit_t * g_input_rate_limit = NULL;
+
+// Requested and effective I2C clock speeds (effective is 0 until calibrated),
+// and the speed calibrated at boot (the fastest we will step back up to)
+uint32_t g_i2c_clock_max = I2C_CLOCK_SPEED;
+uint32_t g_i2c_clock = 0;
+uint32_t g_i2c_clock_calibrated = 0;
+
+// I2C transactions and errors in the current monitoring window
+uint32_t g_i2c_window_transactions = 0;
+uint32_t g_i2c_window_errors = 0;
+
+// I2C bus statistics for each MCP, and how many re-probes to skip for MCPs
+// which keep failing
+i2c_stats_t g_i2c_stats[MCP_COUNT];
+uint8_t g_mcp_probe_failures[MCP_COUNT];
+uint8_t g_mcp_probe_skip[MCP_COUNT];
+
+// Order in which to scan the MCPs found, grouped by mux channel
+uint8_t g_mcp_scan_order[MCP_COUNT];
+uint8_t g_mcp_scan_count = 0;
+
+#if defined(I2C_MUX_ADDRESS)
+// Currently selected mux channel (to avoid redundant channel switches)
+uint8_t g_mux_channel = I2C_MUX_NO_CHANNEL;
+#endif
 
 // Query current value of all bi-stable inputs
 bool g_queryInputs = false;
 
+// Set while handling a query or command burst, so events are published to
+// make room in a full lane rather than dropped
+bool g_event_backpressure = false;
+
+#if defined(LCD_ENABLED)
+// Latest and last rendered port values for the LCD, and which MCPs differ
+// (i.e. need redrawing) or have never been rendered
+uint16_t g_lcd_value[LCD_MCP_COUNT];
+uint16_t g_lcd_rendered[LCD_MCP_COUNT];
+uint8_t g_lcd_pending = 0;
+uint8_t g_lcd_valid = 0;
+uint32_t g_lcd_refresh_ms = LCD_REFRESH_MS;
+
+// The latest port values are handed to the display task under a spinlock,
+// and anything which touches the display (including the Rack32 library
+// when it flashes the MQTT LEDs) holds the mutex
+portMUX_TYPE g_lcd_mailbox_lock = portMUX_INITIALIZER_UNLOCKED;
+SemaphoreHandle_t g_lcd_mutex = NULL;
+#endif
+
+// Arenas for event and schema/telemetry JsonDocuments
+alignas(8) uint8_t g_event_arena_buffer[EVENT_ARENA_SIZE];
+JsonArena g_event_arena(g_event_arena_buffer, sizeof(g_event_arena_buffer));
+#if defined(OXRS_ROOM8266)
+JsonArena g_schema_arena(SCHEMA_ARENA_SIZE);
+#else
+alignas(8) uint8_t g_schema_arena_buffer[SCHEMA_ARENA_SIZE];
+JsonArena g_schema_arena(g_schema_arena_buffer, sizeof(g_schema_arena_buffer));
+#endif
+
+// Lowest free heap seen (the ESP32 keeps track of this itself)
+#if defined(OXRS_ROOM8266)
+uint32_t g_heap_min_free = UINT32_MAX;
+#endif
+
+// Heap allocations which failed, including the heap fallbacks of our JSON
+// arenas (ESP32 only, the ESP8266 core has no hook for this)
+volatile uint32_t g_heap_alloc_failures = 0;
+
+// Health alerts currently raised (see HEALTH_ALERT_*)
+uint8_t g_health_alerts = 0;
+
+// Main loop timing (reset each time telemetry is published)
+uint32_t g_loop_count = 0;
+uint32_t g_loop_max_us = 0;
+uint64_t g_loop_total_us = 0;
+
+#if defined(LCD_ENABLED)
+// Longest the main loop has waited on the display task (reset each time
+// telemetry is published), and how many publishes and passes of the
+// hardware library's loop didn't wait for it
+uint32_t g_lcd_lock_wait_max_us = 0;
+uint32_t g_lcd_publish_unlocked = 0;
+uint32_t g_lcd_loop_deferred = 0;
+#endif
+
 // How many pins on each MCP are we controlling (defaults to all 16)
 // Set via "outputsPerMcp" integer config option - should be set via
 // the REST API so it is persisted to SPIFFS and loaded early enough
@@ -75,17 +742,102 @@ uint8_t g_mcp_output_pins = MCP_PIN_COUNT;
 // *  4 -> 4 INP / 4 OUTP ; PORT_LAYOUT_IO_64_64
 // *  6 -> 6 INP / 2 OUTP ; PORT_LAYOUT_IO_96_32
 // *  8 -> 8 INP / 0 OUTP ; PORT_LAYOUT_INPUT_AUTO  (input only)
+//
+// With a mux the partitions are scaled to the number of MCP slots
 uint8_t g_mcp_output_start = MCP_COUNT;
 
+// Set once the I/O is up with its layout - the handlers, display and event
+// indexes all depend on it, so any later change only applies after a restart
+bool g_io_layout_locked = false;
+
+// Production builds for a known rack can fix the layout at compile time
+// (-DFIXED_OUTPUT_START=n -DFIXED_OUTPUTS_PER_MCP=8|16) so the role checks
+// and index maths constant-fold, otherwise it is configured at runtime
+template <uint8_t OUTPUT_START, uint8_t OUTPUT_PINS>
+struct FixedLayout
+{
+  static_assert(OUTPUT_START <= MCP_COUNT, "FIXED_OUTPUT_START must be <= MCP_COUNT");
+  static_assert(OUTPUT_PINS == 8 || OUTPUT_PINS == MCP_PIN_COUNT, "FIXED_OUTPUTS_PER_MCP must be 8 or 16");
+
+  static constexpr bool configurable() { return false; }
+  static constexpr uint8_t outputStart() { return OUTPUT_START; }
+  static constexpr uint8_t outputPins() { return OUTPUT_PINS; }
+};
+
+struct RuntimeLayout
+{
+  static constexpr bool configurable() { return true; }
+  static uint8_t outputStart() { return g_mcp_output_start; }
+  static uint8_t outputPins() { return g_mcp_output_pins; }
+};
+
+#if defined(FIXED_OUTPUT_START) && defined(FIXED_OUTPUTS_PER_MCP)
+typedef FixedLayout<FIXED_OUTPUT_START, FIXED_OUTPUTS_PER_MCP> Layout;
+#else
+typedef RuntimeLayout Layout;
+#endif
+
 /*--------------------------- Global Objects -----------------------------*/
-// I/O buffers
-Adafruit_MCP23X17 mcp23017[MCP_COUNT];
+// Logs go via the hardware library once it has started (so they also go to
+// MQTT), and straight to serial before that (e.g. during the early boot)
+class Logger : public Print
+{
+public:
+  size_t write(uint8_t character) override
+  {
+    return g_oxrs_ready ? oxrs.write(character) : Serial.write(character);
+  }
+
+  size_t write(const uint8_t * buffer, size_t size) override
+  {
+    return g_oxrs_ready ? oxrs.write(buffer, size) : Serial.write(buffer, size);
+  }
+};
+Logger logger;
+
+// UDP multicast event stream (disabled if port is 0)
+#if defined(WIFI_MODE)
+WiFiUDP udp;
+#else
+EthernetUDP udp;
+#endif
+IPAddress g_udp_group;
+uint16_t g_udp_port = 0;
+uint8_t g_udp_format = UDP_FORMAT_FRAME;
+bool g_udp_commands = false;
+bool g_udp_started = false;
+
+// NTP server for wall clock event timestamps (empty if not configured)
+char g_ntp_server[64] = "";
+#if !defined(WIFI_MODE)
+EthernetUDP ntpUdp;
+IPAddress g_ntp_ip;
+bool g_ntp_started = false;
+bool g_ntp_pending = false;
+uint32_t g_ntp_request_ms = 0;
+uint32_t g_ntp_last_ms = 0;
+uint32_t g_ntp_interval_ms = 0;
+#endif
 
-// Input handler
-OXRS_Input oxrsInput[MCP_COUNT];
+// Handler storage, only for the MCPs found - from an arena sized after the
+// boot scan, anything hot-plugged later comes from the heap
+handler_slot_t * g_handler_arena = NULL;
+uint8_t g_handler_arena_size = 0;
+uint8_t g_handler_arena_used = 0;
+uint8_t g_handler_heap_used = 0;
+handler_slot_t * g_mcp_handler[MCP_COUNT];
 
-// Output handlers
-OXRS_Output oxrsOutput[MCP_COUNT];
+// Input handlers (NULL unless the MCP is present and used for inputs)
+OXRS_Input * oxrsInput[MCP_COUNT];
+
+// Output handlers (NULL unless the MCP is present and used for outputs)
+OXRS_Output * oxrsOutput[MCP_COUNT];
+
+// The I/O config from the cache plus everything received from the hardware
+// library since, merged per option, kept in RAM so it can be re-applied in
+// full to any MCPs which turn up later (the EEPROM cache is size-capped, so
+// may not hold all of it)
+JsonDocument g_config_stash;
 
 /*--------------------------- Program ------------------------------------*/
 
@@ -93,17 +845,254 @@ OXRS_Output oxrsOutput[MCP_COUNT];
  * Helper functions
  */
 
-uint8_t getMinInputIndex()
+void lockLCD()
+{
+#if defined(LCD_ENABLED)
+  // Recursive as config/command callbacks can touch the display from
+  // within oxrs.loop()
+  if (g_lcd_mutex) { xSemaphoreTakeRecursive(g_lcd_mutex, portMAX_DELAY); }
+#endif
+}
+
+bool tryLockLCD()
+{
+#if defined(LCD_ENABLED)
+  // For callers which mustn't be held up by rendering at all
+  if (g_lcd_mutex) { return xSemaphoreTakeRecursive(g_lcd_mutex, 0) == pdTRUE; }
+#endif
+  return true;
+}
+
+void unlockLCD()
+{
+#if defined(LCD_ENABLED)
+  if (g_lcd_mutex) { xSemaphoreGiveRecursive(g_lcd_mutex); }
+#endif
+}
+
+bool publishStatus(JsonVariant json)
+{
+  // Never wait on the display task, if it is mid-render publish straight to
+  // MQTT (the hardware library would only have flashed its MQTT tx LED)
+  if (!tryLockLCD())
+  {
+    #if defined(LCD_ENABLED)
+    g_lcd_publish_unlocked++;
+    #endif
+    return oxrs.getMQTT()->publishStatus(json);
+  }
+
+  bool ok = oxrs.publishStatus(json);
+  unlockLCD();
+  return ok;
+}
+
+bool publishTelemetry(JsonVariant json)
+{
+  if (!tryLockLCD())
+  {
+    #if defined(LCD_ENABLED)
+    g_lcd_publish_unlocked++;
+    #endif
+    return oxrs.getMQTT()->publishTelemetry(json);
+  }
+
+  bool ok = oxrs.publishTelemetry(json);
+  unlockLCD();
+  return ok;
+}
+
+bool selectMcp(uint8_t mcp)
+{
+#if defined(I2C_MUX_ADDRESS)
+  // Only switch channels if this MCP is on a different one
+  if (MCP_I2C_CHANNEL[mcp] == g_mux_channel)
+    return true;
+
+  Wire.beginTransmission(I2C_MUX_ADDRESS);
+  Wire.write(1 << MCP_I2C_CHANNEL[mcp]);
+  if (Wire.endTransmission() != 0)
+  {
+    // Whatever channel was open may still be, so the caller must not go
+    // ahead (the same address on that channel is a different MCP)
+    g_mux_channel = I2C_MUX_NO_CHANNEL;
+    return false;
+  }
+
+  g_mux_channel = MCP_I2C_CHANNEL[mcp];
+#endif
+  return true;
+}
+
+void printMcpAddress(uint8_t mcp)
+{
+#if defined(I2C_MUX_ADDRESS)
+  logger.print(F("ch"));
+  logger.print(MCP_I2C_CHANNEL[mcp]);
+  logger.print(F(" "));
+#endif
+  logger.print(F("0x"));
+  logger.print(MCP_I2C_ADDRESS[mcp], HEX);
+}
+
+void countMcpTransaction(uint8_t mcp, bool ok, uint8_t bytes, uint32_t startUs)
+{
+  i2c_stats_t * stats = &g_i2c_stats[mcp];
+  stats->transactions++;
+  stats->bytes += bytes;
+  stats->busUs += micros() - startUs;
+  if (!ok) { stats->errors++; }
+}
+
+bool mcpProbe(uint8_t mcp)
+{
+  // Check if there is anything responding on this address
+  uint32_t startUs = micros();
+  bool ok = selectMcp(mcp);
+  if (ok)
+  {
+    Wire.beginTransmission(MCP_I2C_ADDRESS[mcp]);
+    ok = Wire.endTransmission() == 0;
+  }
+
+  // Empty addresses are probed all the time, only count MCPs we know about
+  if (bitRead(g_mcps_found, mcp))
+  {
+    countMcpTransaction(mcp, ok, 0, startUs);
+  }
+  return ok;
+}
+
+void countI2CTransaction(uint8_t mcp, bool ok, uint8_t bytes, uint32_t startUs)
+{
+  countMcpTransaction(mcp, ok, bytes, startUs);
+
+  // Keep track of the error rate so we can step the clock down if needed
+  g_i2c_window_transactions++;
+  if (!ok) { g_i2c_window_errors++; }
+}
+
+bool mcpRead16(uint8_t mcp, uint8_t reg, uint16_t * value)
+{
+  // Read a port A/B register pair (port A in the low byte)
+  uint32_t startUs = micros();
+  if (!selectMcp(mcp))
+  {
+    countI2CTransaction(mcp, false, 0, startUs);
+    return false;
+  }
+
+  Wire.beginTransmission(MCP_I2C_ADDRESS[mcp]);
+  Wire.write(reg);
+  bool ok = (Wire.endTransmission(false) == 0) && (Wire.requestFrom(MCP_I2C_ADDRESS[mcp], (uint8_t)2) == 2);
+
+  countI2CTransaction(mcp, ok, 3, startUs);
+  if (!ok)
+    return false;
+
+  uint8_t portA = Wire.read();
+  uint8_t portB = Wire.read();
+  *value = (portB << 8) | portA;
+  return true;
+}
+
+bool mcpRead16Retry(uint8_t mcp, uint8_t reg, uint16_t * value)
+{
+  // Give a single glitch another chance before giving up on this MCP
+  for (uint8_t retry = 0; retry < I2C_READ_RETRIES; retry++)
+  {
+    if (mcpRead16(mcp, reg, value))
+      return true;
+
+    g_i2c_stats[mcp].retries++;
+  }
+  return mcpRead16(mcp, reg, value);
+}
+
+bool mcpWriteRegisters(uint8_t mcp, uint8_t reg, const uint8_t * values, uint8_t count)
+{
+  // Burst write a run of sequential registers in a single transaction
+  uint32_t startUs = micros();
+  if (!selectMcp(mcp))
+  {
+    countI2CTransaction(mcp, false, 0, startUs);
+    return false;
+  }
+
+  Wire.beginTransmission(MCP_I2C_ADDRESS[mcp]);
+  Wire.write(reg);
+  Wire.write(values, count);
+  bool ok = Wire.endTransmission() == 0;
+
+  countI2CTransaction(mcp, ok, count + 1, startUs);
+  return ok;
+}
+
+bool mcpWrite16(uint8_t mcp, uint8_t reg, uint16_t value)
+{
+  // Write a port A/B register pair (port A in the low byte)
+  uint8_t values[2] = { (uint8_t)(value & 0xFF), (uint8_t)(value >> 8) };
+  return mcpWriteRegisters(mcp, reg, values, 2);
+}
+
+void mcpOffline(uint8_t mcp)
+{
+  if (bitRead(g_mcps_online, mcp) == 0)
+    return;
+
+  // Stop talking to this MCP until it is re-probed and re-initialised
+  bitClear(g_mcps_online, mcp);
+
+  logger.print(F("[stio] lost I/O buffer "));
+  printMcpAddress(mcp);
+  logger.println();
+}
+
+void mcpUpdate16(uint8_t mcp, uint8_t reg, uint16_t value)
+{
+  // Push a config change to an MCP (offline MCPs get it when re-initialised)
+  if (bitRead(g_mcps_online, mcp) && !mcpWrite16(mcp, reg, value))
+  {
+    mcpOffline(mcp);
+  }
+}
+
+uint64_t getMicros()
+{
+  // Microseconds since boot, without the 32-bit micros() ~70 minute rollover
+#if defined(ESP32)
+  return esp_timer_get_time();
+#else
+  return micros64();
+#endif
+}
+
+void addEventTimestamp(JsonVariant json, uint64_t timestamp)
+{
+  // When the event occurred, in microseconds since boot
+  json["timestamp"] = timestamp;
+
+  // And as wall clock time (milliseconds since epoch) if we know it
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  if (now.tv_sec > MIN_VALID_EPOCH)
+  {
+    uint64_t nowMs = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+    json["epochMs"] = nowMs - (getMicros() - timestamp) / 1000;
+  }
+}
+
+uint16_t getMinInputIndex()
 {
   // Remember our indexes are 1-based
   return 1;
 }
 
-uint8_t getMaxInputIndex()
+uint16_t getMaxInputIndex()
 {
   // Remember our indexes are 1-based
   // Search for highest input MCP found
-  for (int i = g_mcp_output_start - 1; i >= 0; i--)
+  for (int i = Layout::outputStart() - 1; i >= 0; i--)
   {
     if (bitRead(g_mcps_found, i))
     {
@@ -114,20 +1103,20 @@ uint8_t getMaxInputIndex()
   return getMinInputIndex();
 }
 
-uint8_t getMinOutputIndex()
+uint16_t getMinOutputIndex()
 {
   // Remember our indexes are 1-based
-  return g_mcp_output_start * MCP_PIN_COUNT + 1;
+  return Layout::outputStart() * MCP_PIN_COUNT + 1;
 }
 
-uint8_t getMaxOutputIndex()
+uint16_t getMaxOutputIndex()
 {
   // Search for highest MCP found
-  for (int i = 7; i >= g_mcp_output_start; i--)
+  for (int i = MCP_COUNT - 1; i >= Layout::outputStart(); i--)
   {
     if (bitRead(g_mcps_found, i))
     {
-      return ((i + 1 - g_mcp_output_start) * g_mcp_output_pins + getMinOutputIndex() - 1);
+      return ((i + 1 - Layout::outputStart()) * Layout::outputPins() + getMinOutputIndex() - 1);
     }
   }
   // No output MCP found
@@ -178,7 +1167,7 @@ uint8_t parseInputType(const char *inputType)
     return TOGGLE;
   }
 
-  oxrs.println(F("[stio] invalid input type"));
+  logger.println(F("[stio] invalid input type"));
   return INVALID_INPUT_TYPE;
 }
 
@@ -306,78 +1295,206 @@ void getInputEventType(char eventType[], uint8_t type, uint8_t state)
   }
 }
 
-void getOutputType(char outputType[], uint8_t type)
+// Must match the order of the codes returned by getInputEventCode()
+const char * const INPUT_EVENT_NAMES[INPUT_EVENT_COUNT] = {
+  "single", "double", "triple", "quad", "penta", "hold", "release",
+  "closed", "open", "press", "up", "down",
+  "normal", "alarm", "tamper", "short", "fault",
+  "on", "off", "toggle"
+};
+
+void createInputEventEnum(JsonObject parent)
 {
-  // Determine what type of output we have
-  sprintf_P(outputType, PSTR("error"));
-  switch (type)
+  JsonArray eventEnum = parent["enum"].to<JsonArray>();
+
+  for (uint8_t code = 0; code < INPUT_EVENT_COUNT; code++)
   {
-  case MOTOR:
-    sprintf_P(outputType, PSTR("motor"));
-    break;
-  case RELAY:
-    sprintf_P(outputType, PSTR("relay"));
-    break;
-  case TIMER:
-    sprintf_P(outputType, PSTR("timer"));
-    break;
+    eventEnum.add(INPUT_EVENT_NAMES[code]);
   }
 }
 
-void getOutputEventType(char eventType[], uint8_t type, uint8_t state)
+uint8_t parseInputEvent(const char *inputEvent)
 {
-  // Determine what event we need to publish
-  sprintf_P(eventType, PSTR("error"));
-  switch (state)
+  for (uint8_t code = 0; code < INPUT_EVENT_COUNT; code++)
   {
-  case RELAY_ON:
-    sprintf_P(eventType, PSTR("on"));
-    break;
-  case RELAY_OFF:
-    sprintf_P(eventType, PSTR("off"));
-    break;
+    if (strcmp(inputEvent, INPUT_EVENT_NAMES[code]) == 0)
+    {
+      return code;
+    }
   }
+
+  logger.println(F("[stio] invalid input event"));
+  return INVALID_INPUT_EVENT;
 }
 
-void setInputType(uint8_t mcp, uint8_t pin, uint8_t inputType)
+uint8_t getInputEventCode(uint8_t type, uint8_t state)
 {
-  // Configure the display (type constant from LCD library)
-  #if defined(OXRS_RACK32)
-  switch (inputType)
+  // Same mapping as getInputEventType() but without any formatting
+  switch (type)
   {
-  case SECURITY:
-    oxrs.getLCD()->setPinType(mcp, pin, PIN_TYPE_SECURITY);
-    break;
-  default:
-    oxrs.getLCD()->setPinType(mcp, pin, PIN_TYPE_DEFAULT);
+  case BUTTON:
+    switch (state)
+    {
+    case HOLD_EVENT:    return 5;
+    case RELEASE_EVENT: return 6;
+    case 1: case 2: case 3: case 4: case 5:
+      return state - 1;
+    }
     break;
+  case CONTACT:
+    switch (state)
+    {
+    case LOW_EVENT:     return 7;
+    case HIGH_EVENT:    return 8;
+    }
+    break;
+  case PRESS:
+    return 9;
+  case ROTARY:
+    switch (state)
+    {
+    case LOW_EVENT:     return 10;
+    case HIGH_EVENT:    return 11;
+    }
+    break;
+  case SECURITY:
+    switch (state)
+    {
+    case HIGH_EVENT:    return 12;
+    case LOW_EVENT:     return 13;
+    case TAMPER_EVENT:  return 14;
+    case SHORT_EVENT:   return 15;
+    case FAULT_EVENT:   return 16;
+    }
+    break;
+  case SWITCH:
+    switch (state)
+    {
+    case LOW_EVENT:     return 17;
+    case HIGH_EVENT:    return 18;
+    }
+    break;
+  case TOGGLE:
+    return 19;
+  }
+
+  return INVALID_INPUT_EVENT;
+}
+
+void getOutputType(char outputType[], uint8_t type)
+{
+  // Determine what type of output we have
+  sprintf_P(outputType, PSTR("error"));
+  switch (type)
+  {
+  case MOTOR:
+    sprintf_P(outputType, PSTR("motor"));
+    break;
+  case RELAY:
+    sprintf_P(outputType, PSTR("relay"));
+    break;
+  case TIMER:
+    sprintf_P(outputType, PSTR("timer"));
+    break;
+  }
+}
+
+void getOutputEventType(char eventType[], uint8_t type, uint8_t state)
+{
+  // Determine what event we need to publish
+  sprintf_P(eventType, PSTR("error"));
+  switch (state)
+  {
+  case RELAY_ON:
+    sprintf_P(eventType, PSTR("on"));
+    break;
+  case RELAY_OFF:
+    sprintf_P(eventType, PSTR("off"));
+    break;
+  }
+}
+
+void setInputType(uint8_t mcp, uint8_t pin, uint8_t inputType)
+{
+  // Configure the display (type constant from LCD library)
+  #if defined(LCD_ENABLED)
+  if (mcp < LCD_MCP_COUNT && g_oxrs_ready)
+  {
+    lockLCD();
+    switch (inputType)
+    {
+    case SECURITY:
+      oxrs.getLCD()->setPinType(mcp, pin, PIN_TYPE_SECURITY);
+      break;
+    default:
+      oxrs.getLCD()->setPinType(mcp, pin, PIN_TYPE_DEFAULT);
+      break;
+    }
+    unlockLCD();
   }
   #endif
 
   // Pass this update to the input handler
-  oxrsInput[mcp].setType(pin, inputType);
+  if (oxrsInput[mcp])
+  {
+    oxrsInput[mcp]->setType(pin, inputType);
+  }
 }
 
 void setInputInvert(uint8_t mcp, uint8_t pin, int invert)
 {
-  // Configure the display
-  #if defined(OXRS_RACK32)
-  oxrs.getLCD()->setPinInvert(mcp, pin, invert);
-  #endif
+  // Inversion is done by the MCP (IPOL) so the values passed to the input
+  // handler and display are already inverted - neither need to know
+  bitWrite(g_mcp_ipol[mcp], pin, invert ? 1 : 0);
+  mcpUpdate16(mcp, MCP_REG_IPOL, g_mcp_ipol[mcp]);
+}
 
-  // Pass this update to the input handler
-  oxrsInput[mcp].setInvert(pin, invert);
+void setInputPullup(uint8_t mcp, uint8_t pin, int pullup)
+{
+  bitWrite(g_mcp_gppu[mcp], pin, pullup ? 1 : 0);
+  mcpUpdate16(mcp, MCP_REG_GPPU, g_mcp_gppu[mcp]);
 }
 
 void setInputDisabled(uint8_t mcp, uint8_t pin, int disabled)
 {
   // Configure the display
-  #if defined(OXRS_RACK32)
-  oxrs.getLCD()->setPinDisabled(mcp, pin, disabled);
+  #if defined(LCD_ENABLED)
+  if (mcp < LCD_MCP_COUNT && g_oxrs_ready)
+  {
+    lockLCD();
+    oxrs.getLCD()->setPinDisabled(mcp, pin, disabled);
+    unlockLCD();
+  }
   #endif
 
   // Pass this update to the input handler
-  oxrsInput[mcp].setDisabled(pin, disabled);
+  if (oxrsInput[mcp])
+  {
+    oxrsInput[mcp]->setDisabled(pin, disabled);
+  }
+}
+
+void setInputRateLimit(uint16_t index, uint8_t rate)
+{
+  if (!g_input_rate_limit)
+  {
+    // Nothing to do until the first input gets a rate limit
+    if (rate == 0)
+      return;
+
+    g_input_rate_limit = (rate_limit_t *)calloc(MCP_COUNT * MCP_PIN_COUNT, sizeof(rate_limit_t));
+    if (!g_input_rate_limit)
+    {
+      logger.println(F("[stio] no memory for input rate limits"));
+      return;
+    }
+  }
+
+  // Start with a full bucket (i.e. allow a one second burst)
+  rate_limit_t * limit = &g_input_rate_limit[index - 1];
+  limit->rate = rate;
+  limit->tokens = rate;
+  limit->refillMs = millis();
 }
 
 void setDefaultInputType(uint8_t inputType)
@@ -419,7 +1536,7 @@ uint8_t parseOutputType(const char *outputType)
     return TIMER;
   }
 
-  oxrs.println(F("[stio] invalid output type"));
+  logger.println(F("[stio] invalid output type"));
   return INVALID_OUTPUT_TYPE;
 }
 
@@ -428,19 +1545,19 @@ void setDefaultOutputType(uint8_t outputType)
   // Set all pins on all MCPs to this default output type
   for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
   {
-    if (bitRead(g_mcps_found, mcp) == 0)
+    if (!oxrsOutput[mcp])
       continue;
 
-    for (uint8_t pin = 0; pin < g_mcp_output_pins; pin++)
+    for (uint8_t pin = 0; pin < Layout::outputPins(); pin++)
     {
-      oxrsOutput[mcp].setType(pin, outputType);
+      oxrsOutput[mcp]->setType(pin, outputType);
     }
   }
 }
 
 bool isInputMcp(uint8_t mcp)
 {
-  return mcp < g_mcp_output_start;
+  return mcp < Layout::outputStart();
 }
 
 bool isOutputMcp(uint8_t mcp)
@@ -448,14 +1565,222 @@ bool isOutputMcp(uint8_t mcp)
   return !isInputMcp(mcp);
 }
 
+uint16_t getMcpIodir(uint8_t mcp)
+{
+  // All pins are inputs on input MCPs, and outputs on output MCPs
+  return isInputMcp(mcp) ? 0xFFFF : 0x0000;
+}
+
+void setI2CClock(uint32_t clock)
+{
+  Wire.setClock(clock);
+  g_i2c_clock = clock;
+
+  // Start a fresh monitoring window at the new speed
+  g_i2c_window_transactions = 0;
+  g_i2c_window_errors = 0;
+}
+
+bool testI2CClock()
+{
+  // Read back the direction register from each MCP and check it matches
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    if (bitRead(g_mcps_online, mcp) == 0)
+      continue;
+
+    for (uint8_t i = 0; i < I2C_CALIBRATION_READS; i++)
+    {
+      uint16_t iodir;
+      if (!mcpRead16(mcp, MCP_REG_IODIR, &iodir) || iodir != getMcpIodir(mcp))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+void calibrateI2CBus()
+{
+  logger.print(F("[stio] calibrating I2C clock (max "));
+  logger.print(g_i2c_clock_max);
+  logger.println(F("Hz)..."));
+
+  // Find the fastest clock speed (up to our max) the bus is error free at,
+  // falling back to the slowest speed if there are errors at all speeds
+  uint32_t clock = I2C_CLOCK_STEPS[I2C_CLOCK_STEP_COUNT - 1];
+  for (uint8_t i = 0; i < I2C_CLOCK_STEP_COUNT; i++)
+  {
+    if (I2C_CLOCK_STEPS[i] > g_i2c_clock_max)
+      continue;
+
+    setI2CClock(I2C_CLOCK_STEPS[i]);
+
+    logger.print(F(" - "));
+    logger.print(g_i2c_clock);
+    logger.print(F("Hz..."));
+
+    if (testI2CClock())
+    {
+      logger.println(F("ok"));
+      clock = I2C_CLOCK_STEPS[i];
+      break;
+    }
+    logger.println(F("errors"));
+  }
+
+  // Start monitoring from a clean slate, and don't step back up past here
+  setI2CClock(clock);
+  g_i2c_clock_calibrated = clock;
+}
+
+void monitorI2CBus()
+{
+  // Check the error rate at the end of each monitoring window
+  static uint32_t lastMonitor = 0;
+  if ((millis() - lastMonitor) < I2C_MONITOR_MS)
+    return;
+
+  lastMonitor = millis();
+
+  // Consecutive windows without any errors
+  static uint8_t cleanWindows = 0;
+  cleanWindows = g_i2c_window_errors == 0 ? cleanWindows + 1 : 0;
+
+  if (g_i2c_window_errors >= I2C_ERROR_MIN_COUNT && 
+      (g_i2c_window_errors * 1000) > (g_i2c_window_transactions * I2C_ERROR_PERMILLE))
+  {
+    // Step down to the next slowest clock speed (if there is one)
+    for (uint8_t i = 0; i < I2C_CLOCK_STEP_COUNT; i++)
+    {
+      if (I2C_CLOCK_STEPS[i] < g_i2c_clock)
+      {
+        logger.print(F("[stio] too many I2C errors ("));
+        logger.print(g_i2c_window_errors);
+        logger.print(F("/"));
+        logger.print(g_i2c_window_transactions);
+        logger.print(F("), stepping clock down to "));
+        logger.print(I2C_CLOCK_STEPS[i]);
+        logger.println(F("Hz"));
+
+        setI2CClock(I2C_CLOCK_STEPS[i]);
+        return;
+      }
+    }
+  }
+
+  // Step back up to the next fastest clock speed if the bus has been clean
+  // for a while (the errors may have been transient), but only if it passes
+  // the same read-back test as at boot
+  if (cleanWindows >= I2C_STEP_UP_WINDOWS && g_i2c_clock < g_i2c_clock_calibrated)
+  {
+    cleanWindows = 0;
+
+    for (int8_t i = I2C_CLOCK_STEP_COUNT - 1; i >= 0; i--)
+    {
+      if (I2C_CLOCK_STEPS[i] > g_i2c_clock)
+      {
+        uint32_t clock = g_i2c_clock;
+        setI2CClock(I2C_CLOCK_STEPS[i]);
+
+        logger.print(F("[stio] I2C bus clean, stepping clock up to "));
+        logger.print(g_i2c_clock);
+        logger.print(F("Hz..."));
+
+        if (testI2CClock())
+        {
+          logger.println(F("ok"));
+        }
+        else
+        {
+          logger.println(F("errors"));
+          setI2CClock(clock);
+        }
+        return;
+      }
+    }
+  }
+
+  // Start a new monitoring window
+  g_i2c_window_transactions = 0;
+  g_i2c_window_errors = 0;
+}
+
+void backOffMcp(uint8_t mcp)
+{
+  // Empty addresses NACK straight away, only back off from MCPs we know are
+  // there but failing (and possibly timing out) so they don't stall the loop
+  if (bitRead(g_mcps_found, mcp) == 0)
+    return;
+
+  if (g_mcp_probe_failures[mcp] < I2C_BACKOFF_MAX_SHIFT) { g_mcp_probe_failures[mcp]++; }
+  g_mcp_probe_skip[mcp] = (1 << g_mcp_probe_failures[mcp]) - 1;
+
+  logger.print(F("[stio] I/O buffer "));
+  printMcpAddress(mcp);
+  logger.print(F(" not responding, next re-probe in "));
+  logger.print((uint32_t)(g_mcp_probe_skip[mcp] + 1) * I2C_REPROBE_MS / 1000);
+  logger.println(F("s"));
+}
+
+void addI2CStats(JsonArray json)
+{
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    if (bitRead(g_mcps_found, mcp) == 0)
+      continue;
+
+    i2c_stats_t * stats = &g_i2c_stats[mcp];
+
+    JsonObject mcpStats = json.add<JsonObject>();
+#if defined(I2C_MUX_ADDRESS)
+    mcpStats["channel"] = MCP_I2C_CHANNEL[mcp];
+#endif
+    mcpStats["address"] = MCP_I2C_ADDRESS[mcp];
+    mcpStats["online"] = (bool)bitRead(g_mcps_online, mcp);
+    mcpStats["transactions"] = stats->transactions;
+    mcpStats["bytes"] = stats->bytes;
+    mcpStats["errors"] = stats->errors;
+    mcpStats["retries"] = stats->retries;
+    mcpStats["busUs"] = stats->busUs;
+  }
+}
+
+void queryI2CStats()
+{
+  JsonDocument json(&g_schema_arena);
+  addI2CStats(json["i2cStats"].to<JsonArray>());
+  publishStatus(json.as<JsonVariant>());
+}
+
+void resetI2CStats()
+{
+  memset(g_i2c_stats, 0, sizeof(g_i2c_stats));
+}
+
 uint8_t outpIndex2Mcp(int index)
 {
-  return ((index - getMinOutputIndex()) / g_mcp_output_pins + g_mcp_output_start);
+  return ((index - getMinOutputIndex()) / Layout::outputPins() + Layout::outputStart());
 }
 
 uint8_t outpIndex2Pin(int index)
 {
-  return ((index - getMinOutputIndex()) % g_mcp_output_pins);
+  return ((index - getMinOutputIndex()) % Layout::outputPins());
+}
+
+void setDefaultInputPullup(int pullup)
+{
+  // Set all pins in every MCP slot to this default pull-up config, so any
+  // MCP found later (or which becomes an input MCP) is configured with it
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    g_mcp_gppu[mcp] = pullup ? 0xFFFF : 0x0000;
+
+    if (isInputMcp(mcp))
+    {
+      mcpUpdate16(mcp, MCP_REG_GPPU, g_mcp_gppu[mcp]);
+    }
+  }
 }
 
 void inputConfigSchema(JsonVariant json)
@@ -465,9 +1790,44 @@ void inputConfigSchema(JsonVariant json)
   defaultInputType["description"] = "Set the default input type for anything without explicit configuration below. Defaults to ‘switch’.";
   createInputTypeEnum(defaultInputType);
 
+  JsonObject priorityInputTypes = json["priorityInputTypes"].to<JsonObject>();
+  priorityInputTypes["title"] = "Priority Input Types";
+  priorityInputTypes["description"] = "Events from these input types are published ahead of any others waiting to be published. Defaults to ‘security’.";
+  priorityInputTypes["type"] = "array";
+  priorityInputTypes["uniqueItems"] = true;
+  createInputTypeEnum(priorityInputTypes["items"].to<JsonObject>());
+
+  JsonObject inputTypeEvents = json["inputTypeEvents"].to<JsonObject>();
+  inputTypeEvents["title"] = "Input Type Events";
+  inputTypeEvents["description"] = "Restrict which events are published for all inputs of a type, e.g. only ‘single’ and ‘hold’ for buttons. Any other events are dropped before publishing.";
+  inputTypeEvents["type"] = "array";
+
+  JsonObject typeEventItems = inputTypeEvents["items"].to<JsonObject>();
+  typeEventItems["type"] = "object";
+
+  JsonObject typeEventProperties = typeEventItems["properties"].to<JsonObject>();
+
+  JsonObject typeEventType = typeEventProperties["type"].to<JsonObject>();
+  typeEventType["title"] = "Type";
+  createInputTypeEnum(typeEventType);
+
+  JsonObject typeEvents = typeEventProperties["events"].to<JsonObject>();
+  typeEvents["title"] = "Events";
+  typeEvents["type"] = "array";
+  typeEvents["uniqueItems"] = true;
+  createInputEventEnum(typeEvents["items"].to<JsonObject>());
+
+  JsonArray typeEventRequired = typeEventItems["required"].to<JsonArray>();
+  typeEventRequired.add("type");
+
+  JsonObject internalPullups = json["internalPullups"].to<JsonObject>();
+  internalPullups["title"] = "Internal Pull-ups";
+  internalPullups["description"] = "Enable the internal pull-up resistors on all inputs without explicit configuration below. Disable for breakout boards with external pull-ups.";
+  internalPullups["type"] = "boolean";
+
   JsonObject inputs = json["inputs"].to<JsonObject>();
   inputs["title"] = "Input Configuration";
-  inputs["description"] = "Add configuration for each input in use on your device. The 1-based index specifies which input you wish to configure. The type defines how an input is monitored and what events are emitted. Inverting an input swaps the 'active' state (only useful for 'contact' and 'switch' inputs). Disabling an input stops any events being emitted.";
+  inputs["description"] = "Add configuration for each input in use on your device. The 1-based index specifies which input you wish to configure. The type defines how an input is monitored and what events are emitted. Inverting an input swaps the 'active' state (only useful for 'contact' and 'switch' inputs). The internal pull-up can be enabled or disabled per input. Disabling an input stops any events being emitted.";
   inputs["type"] = "array";
 
   JsonObject items = inputs["items"].to<JsonObject>();
@@ -489,6 +1849,24 @@ void inputConfigSchema(JsonVariant json)
   invert["title"] = "Invert";
   invert["type"] = "boolean";
 
+  JsonObject pullup = properties["pullup"].to<JsonObject>();
+  pullup["title"] = "Internal Pull-up";
+  pullup["type"] = "boolean";
+
+  JsonObject rateLimit = properties["rateLimit"].to<JsonObject>();
+  rateLimit["title"] = "Rate Limit (events/second)";
+  rateLimit["description"] = "Maximum events per second (0 for no limit). Excess events are dropped and the input flagged as chattering, with the number dropped published with the next event, or with the last event dropped (once a second) if no event has been published since.";
+  rateLimit["type"] = "integer";
+  rateLimit["minimum"] = 0;
+  rateLimit["maximum"] = 255;
+
+  JsonObject events = properties["events"].to<JsonObject>();
+  events["title"] = "Events";
+  events["description"] = "Only publish these events for this input (overrides any input type events).";
+  events["type"] = "array";
+  events["uniqueItems"] = true;
+  createInputEventEnum(events["items"].to<JsonObject>());
+
   JsonObject disabled = properties["disabled"].to<JsonObject>();
   disabled["title"] = "Disabled";
   disabled["type"] = "boolean";
@@ -529,6 +1907,11 @@ void outputConfigSchema(JsonVariant json)
   timerSeconds["type"] = "integer";
   timerSeconds["minimum"] = 1;
 
+  JsonObject persist = properties["persist"].to<JsonObject>();
+  persist["title"] = "Persist State";
+  persist["description"] = "Restore the last state of this output at boot, before the network is up (not supported for ‘timer’ outputs). Saved 5 seconds after it stops changing, but to spare the flash no more than 4 times in quick succession and then once an hour.";
+  persist["type"] = "boolean";
+
   JsonObject interlockIndex = properties["interlockIndex"].to<JsonObject>();
   interlockIndex["title"] = "Interlock With Index";
   interlockIndex["type"] = "integer";
@@ -545,28 +1928,93 @@ void outputConfigSchema(JsonVariant json)
 void setConfigSchema()
 {
   // Define our config schema
-  JsonDocument json;
+  JsonDocument json(&g_schema_arena);
   JsonVariant config = json.as<JsonVariant>();
   
-  JsonObject ioConfig = json["ioConfig"].to<JsonObject>();
-  ioConfig["title"] = "Configuration Of Input/Output Ports. ! HINT ! A restart is required before changes will take effect! Reload this browser page after restart has finished!";
-  ioConfig["description"] = "Select the desired partioning of Input and Output ports";
-  ioConfig["type"] = "string";
-  JsonArray ioConfigEnum = ioConfig["enum"].to<JsonArray>();
-  ioConfigEnum.add("io_128_0");
-  ioConfigEnum.add("io_96_32");
-  ioConfigEnum.add("io_64_64");
-  ioConfigEnum.add("io_32_96");
-  ioConfigEnum.add("io_0_128");
-
-  JsonObject outputsPerMcp = json["outputsPerMcp"].to<JsonObject>();
-  outputsPerMcp["title"] = "Number Of Outputs Per MCP. ! HINT ! A restart is required before changes will take effect!";
-  outputsPerMcp["description"] = "Hint ! A restart is required before changes will take effect!";
-  outputsPerMcp["description"] = "Number of outputs connected to each MCP23017 I/O chip, which is dependent on the relay driver used (must be either 8 or 16, defaults to 16).";
-  outputsPerMcp["type"] = "integer";
-  outputsPerMcp["minimum"] = 8;
-  outputsPerMcp["maximum"] = MCP_PIN_COUNT;
-  outputsPerMcp["multipleOf"] = 8;
+  // Only offer the I/O layout when it can be changed, it is compiled in
+  // when FIXED_OUTPUT_START/FIXED_OUTPUTS_PER_MCP are set
+  if (Layout::configurable())
+  {
+    JsonObject ioConfig = json["ioConfig"].to<JsonObject>();
+    ioConfig["title"] = "Configuration Of Input/Output Ports. ! HINT ! A restart is required before changes will take effect! Reload this browser page after restart has finished!";
+    ioConfig["description"] = "Select the desired partioning of Input and Output ports";
+    ioConfig["type"] = "string";
+    JsonArray ioConfigEnum = ioConfig["enum"].to<JsonArray>();
+    ioConfigEnum.add("io_128_0");
+    ioConfigEnum.add("io_96_32");
+    ioConfigEnum.add("io_64_64");
+    ioConfigEnum.add("io_32_96");
+    ioConfigEnum.add("io_0_128");
+
+    JsonObject outputsPerMcp = json["outputsPerMcp"].to<JsonObject>();
+    outputsPerMcp["title"] = "Number Of Outputs Per MCP. ! HINT ! A restart is required before changes will take effect!";
+    outputsPerMcp["description"] = "Hint ! A restart is required before changes will take effect!";
+    outputsPerMcp["description"] = "Number of outputs connected to each MCP23017 I/O chip, which is dependent on the relay driver used (must be either 8 or 16, defaults to 16).";
+    outputsPerMcp["type"] = "integer";
+    outputsPerMcp["minimum"] = 8;
+    outputsPerMcp["maximum"] = MCP_PIN_COUNT;
+    outputsPerMcp["multipleOf"] = 8;
+  }
+
+  JsonObject ntpServer = json["ntpServer"].to<JsonObject>();
+  ntpServer["title"] = "NTP Server";
+  ntpServer["description"] = "Optional NTP server used to add wall clock time to event timestamps (which otherwise are only microseconds since boot).";
+  ntpServer["type"] = "string";
+
+  JsonObject udpMulticast = json["udpMulticast"].to<JsonObject>();
+  udpMulticast["title"] = "UDP Multicast Event Stream";
+  udpMulticast["description"] = "Optionally send every input and output event as a compact binary frame to a UDP multicast group, for low latency local consumers. Events are still published via MQTT.";
+  udpMulticast["type"] = "object";
+
+  JsonObject udpProperties = udpMulticast["properties"].to<JsonObject>();
+
+  JsonObject udpGroup = udpProperties["group"].to<JsonObject>();
+  udpGroup["title"] = "Multicast Group";
+  udpGroup["type"] = "string";
+  udpGroup["format"] = "ipv4";
+
+  JsonObject udpPort = udpProperties["port"].to<JsonObject>();
+  udpPort["title"] = "Port";
+  udpPort["type"] = "integer";
+  udpPort["minimum"] = 1;
+  udpPort["maximum"] = 65535;
+
+  JsonObject udpFormat = udpProperties["format"].to<JsonObject>();
+  udpFormat["title"] = "Format";
+  udpFormat["description"] = "Either compact fixed size binary frames, or MessagePack using the same schema as the JSON status payloads. Defaults to ‘binary’.";
+  udpFormat["type"] = "string";
+  JsonArray udpFormatEnum = udpFormat["enum"].to<JsonArray>();
+  udpFormatEnum.add("binary");
+  udpFormatEnum.add("msgpack");
+
+  JsonObject udpCommands = udpProperties["commands"].to<JsonObject>();
+  udpCommands["title"] = "Accept Commands";
+  udpCommands["description"] = "Accept MessagePack commands and config sent to the multicast group, as a map with a ‘command’ and/or ‘config’ key using the same schema as the JSON payloads. Only enable on trusted networks, config received this way is not persisted.";
+  udpCommands["type"] = "boolean";
+
+  JsonObject retainedState = json["retainedState"].to<JsonObject>();
+  retainedState["title"] = "Retained State Topics";
+  retainedState["description"] = "Also publish the state of each bi-stable input (contact, security, switch) and each output to a retained topic per index (e.g. <status topic>/input/<index>) whenever it changes, so new subscribers get the current state straight from the broker. Every topic is published when enabled and whenever MQTT reconnects.";
+  retainedState["type"] = "boolean";
+
+  JsonObject i2cClockSpeed = json["i2cClockSpeed"].to<JsonObject>();
+  i2cClockSpeed["title"] = "I2C Clock Speed (Hz)";
+  i2cClockSpeed["description"] = "Maximum I2C clock speed. The fastest speed the I/O buffers can reliably run at (up to this maximum) is detected at startup, and the speed is stepped down automatically if I2C errors occur. Defaults to 400000.";
+  i2cClockSpeed["type"] = "integer";
+  JsonArray i2cClockSpeedEnum = i2cClockSpeed["enum"].to<JsonArray>();
+  for (uint8_t i = 0; i < I2C_CLOCK_STEP_COUNT; i++)
+  {
+    i2cClockSpeedEnum.add(I2C_CLOCK_STEPS[i]);
+  }
+
+#if defined(LCD_ENABLED)
+  JsonObject lcdRefreshMs = json["lcdRefreshMs"].to<JsonObject>();
+  lcdRefreshMs["title"] = "LCD Refresh Interval (ms)";
+  lcdRefreshMs["description"] = "Minimum time between port animation redraws, changes in between are coalesced. Defaults to 50ms.";
+  lcdRefreshMs["type"] = "integer";
+  lcdRefreshMs["minimum"] = 1;
+  lcdRefreshMs["maximum"] = 1000;
+#endif
 
   // Do we have any input MCPs?
   if (isInputMcp(0))
@@ -584,48 +2032,150 @@ void setConfigSchema()
   oxrs.setConfigSchema(config);
 }
 
+void jsonPriorityInputTypes(JsonVariant json)
+{
+  // Revert to the default if nothing specified
+  if (json.isNull())
+  {
+    g_priority_input_types = (1 << SECURITY);
+    return;
+  }
+
+  g_priority_input_types = 0;
+  for (JsonVariant type : json.as<JsonArray>())
+  {
+    if (!type.is<const char *>())
+      continue;
+
+    uint8_t inputType = parseInputType(type);
+
+    if (inputType != INVALID_INPUT_TYPE)
+    {
+      bitSet(g_priority_input_types, inputType);
+    }
+  }
+}
+
+uint32_t parseInputEventFilter(JsonVariant json)
+{
+  // Convert a list of events to publish into a mask of events to drop
+  uint32_t filter = (1UL << INPUT_EVENT_COUNT) - 1;
+  for (JsonVariant event : json.as<JsonArray>())
+  {
+    if (!event.is<const char *>())
+      continue;
+
+    uint8_t code = parseInputEvent(event);
+
+    if (code != INVALID_INPUT_EVENT)
+    {
+      bitClear(filter, code);
+    }
+  }
+
+  return filter;
+}
+
+void jsonInputTypeEvents(JsonVariant json)
+{
+  // Publish everything unless a type is listed
+  memset(g_input_type_event_filter, 0, sizeof(g_input_type_event_filter));
+
+  for (JsonVariant typeEvents : json.as<JsonArray>())
+  {
+    if (!typeEvents["type"].is<const char *>())
+    {
+      logger.println(F("[stio] missing input type"));
+      continue;
+    }
+
+    uint8_t inputType = parseInputType(typeEvents["type"]);
+
+    if (inputType != INVALID_INPUT_TYPE && typeEvents.containsKey("events"))
+    {
+      g_input_type_event_filter[inputType] = parseInputEventFilter(typeEvents["events"]);
+    }
+  }
+}
+
+void jsonUdpMulticast(JsonVariant json)
+{
+  // Stop any existing stream, it is restarted on the next event
+  if (g_udp_started)
+  {
+    udp.stop();
+    g_udp_started = false;
+  }
+  g_udp_port = 0;
+
+  if (json.isNull() || !json.containsKey("group") || !json.containsKey("port"))
+    return;
+
+  if (!g_udp_group.fromString(json["group"].as<const char *>()))
+  {
+    logger.println(F("[stio] invalid udp multicast group"));
+    return;
+  }
+
+  g_udp_port = json["port"].as<uint16_t>();
+  g_udp_format = json["format"].isNull() || strcmp(json["format"], "msgpack") != 0 ? UDP_FORMAT_FRAME : UDP_FORMAT_MSGPACK;
+  g_udp_commands = json["commands"].as<bool>();
+}
+
 void jsonIoConfig(const char *ioConfig)
 {
+  if (!Layout::configurable())
+  {
+    logger.println(F("[stio] ioConfig is fixed in this build"));
+    return;
+  }
+
+  // Partitions are defined in eighths of the MCP slots available
+  uint8_t inputEighths;
+
   if (strcmp(ioConfig, "io_128_0") == 0)
   {
-    g_mcp_output_start = 8;
+    inputEighths = 8;
   }
   else if (strcmp(ioConfig, "io_96_32") == 0)
   {
-    g_mcp_output_start = 6;
+    inputEighths = 6;
   }
   else if (strcmp(ioConfig, "io_64_64") == 0)
   {
-    g_mcp_output_start = 4;
+    inputEighths = 4;
   }
   else if (strcmp(ioConfig, "io_32_96") == 0)
   {
-    g_mcp_output_start = 2;
+    inputEighths = 2;
   }
   else if (strcmp(ioConfig, "io_0_128") == 0)
   {
-    g_mcp_output_start = 0;
+    inputEighths = 0;
   }
   else
   {
-    oxrs.println(F("[stio] invalid ioConfig enum"));
+    logger.println(F("[stio] invalid ioConfig enum"));
+    return;
   }
+
+  g_mcp_output_start = (MCP_COUNT * inputEighths) / 8;
 }
 
-uint8_t getInputIndex(JsonVariant json)
+uint16_t getInputIndex(JsonVariant json)
 {
   if (!json.containsKey("index"))
   {
-    oxrs.println(F("[stio] missing input index"));
+    logger.println(F("[stio] missing input index"));
     return 0;
   }
   
-  uint8_t index = json["index"].as<uint8_t>();
+  uint16_t index = json["index"].as<uint16_t>();
 
   // Check the index is valid for this device
   if (index < getMinInputIndex() || index > getMaxInputIndex())
   {
-    oxrs.println(F("[stio] invalid input index"));
+    logger.println(F("[stio] invalid input index"));
     return 0;
   }
 
@@ -634,14 +2184,14 @@ uint8_t getInputIndex(JsonVariant json)
 
 void jsonInputConfig(JsonVariant json)
 {
-  uint8_t index = getInputIndex(json);
+  uint16_t index = getInputIndex(json);
   if (index == 0) return;
 
   // Work out the MCP and pin we are configuring
   int mcp = (index - 1) / MCP_PIN_COUNT;
   int pin = (index - 1) % MCP_PIN_COUNT;
   
-  if (json.containsKey("type"))
+  if (json["type"].is<const char *>())
   {
     uint8_t inputType = parseInputType(json["type"]);    
 
@@ -656,26 +2206,41 @@ void jsonInputConfig(JsonVariant json)
     setInputInvert(mcp, pin, json["invert"].as<bool>());
   }
 
-  if (json.containsKey("disabled"))
+  if (json.containsKey("rateLimit"))
   {
-    setInputDisabled(mcp, pin, json["disabled"].as<bool>());
+    setInputRateLimit(index, json["rateLimit"].isNull() ? 0 : json["rateLimit"].as<uint8_t>());
   }
-}
 
-uint8_t getOutputIndex(JsonVariant json)
-{
+  if (json.containsKey("events"))
+  {
+    g_input_event_filter[index - 1] = json["events"].isNull() ? 0 : (parseInputEventFilter(json["events"]) | INPUT_EVENT_FILTER_SET);
+  }
+
+  if (json.containsKey("pullup"))
+  {
+    setInputPullup(mcp, pin, json["pullup"].isNull() ? MCP_INTERNAL_PULLUPS : json["pullup"].as<bool>());
+  }
+
+  if (json.containsKey("disabled"))
+  {
+    setInputDisabled(mcp, pin, json["disabled"].as<bool>());
+  }
+}
+
+uint16_t getOutputIndex(JsonVariant json)
+{
   if (!json.containsKey("index"))
   {
-    oxrs.println(F("[stio] missing output index"));
+    logger.println(F("[stio] missing output index"));
     return 0;
   }
   
-  uint8_t index = json["index"].as<uint8_t>();
+  uint16_t index = json["index"].as<uint16_t>();
 
   // Check the index is valid for this device
   if (index < getMinOutputIndex() || index > getMaxOutputIndex())
   {
-    oxrs.println(F("[stio] invalid output index"));
+    logger.println(F("[stio] invalid output index"));
     return 0;
   }
 
@@ -684,12 +2249,17 @@ uint8_t getOutputIndex(JsonVariant json)
 
 void jsonOutputConfig(JsonVariant json)
 {
-  uint8_t index = getOutputIndex(json);
+  uint16_t index = getOutputIndex(json);
   if (index == 0) return;
 
   // Work out the MCP and pin we are configuring
   uint8_t mcp = outpIndex2Mcp(index);
   uint8_t pin = outpIndex2Pin(index);
+
+  // Nothing to configure if this MCP isn't present (the config is re-applied
+  // if it turns up later)
+  if (!oxrsOutput[mcp])
+    return;
   
   if (json.containsKey("type"))
   {
@@ -697,7 +2267,7 @@ void jsonOutputConfig(JsonVariant json)
 
     if (outputType != INVALID_OUTPUT_TYPE)
     {
-      oxrsOutput[mcp].setType(pin, outputType);
+      oxrsOutput[mcp]->setType(pin, outputType);
     }
   }
   
@@ -705,11 +2275,11 @@ void jsonOutputConfig(JsonVariant json)
   {
     if (json["timerSeconds"].isNull())
     {
-      oxrsOutput[mcp].setTimer(pin, DEFAULT_TIMER_SECS);
+      oxrsOutput[mcp]->setTimer(pin, DEFAULT_TIMER_SECS);
     }
     else
     {
-      oxrsOutput[mcp].setTimer(pin, json["timerSeconds"].as<int>());
+      oxrsOutput[mcp]->setTimer(pin, json["timerSeconds"].as<int>());
     }
   }
   
@@ -718,39 +2288,284 @@ void jsonOutputConfig(JsonVariant json)
     // If an empty message then treat as 'unlocked' - i.e. interlock with ourselves
     if (json["interlockIndex"].isNull())
     {
-      oxrsOutput[mcp].setInterlock(pin, pin);
+      oxrsOutput[mcp]->setInterlock(pin, pin);
     }
     else
     {
-      uint8_t interlock_index = json["interlockIndex"].as<uint8_t>();
+      uint16_t interlock_index = json["interlockIndex"].as<uint16_t>();
      
       uint8_t interlock_mcp = outpIndex2Mcp(interlock_index);
       uint8_t interlock_pin = outpIndex2Pin(interlock_index);
       
       if (interlock_mcp == mcp)
       {
-        oxrsOutput[mcp].setInterlock(pin, interlock_pin);
+        oxrsOutput[mcp]->setInterlock(pin, interlock_pin);
       }
       else
       {
-        oxrs.println(F("[stio] lock must be with pin on same mcp"));
+        logger.println(F("[stio] lock must be with pin on same mcp"));
+      }
+    }
+  }
+
+  if (json.containsKey("persist"))
+  {
+    bitWrite(g_mcp_persist[mcp], pin, json["persist"].as<bool>());
+    g_output_store_dirty = true;
+    g_output_store_changed_ms = millis();
+  }
+}
+
+// Config options cached so the I/O can be configured at boot before the
+// network is up - anything network related is left until the full config
+const char * const CONFIG_CACHE_KEYS[] = {
+  "ioConfig", "outputsPerMcp", "i2cClockSpeed",
+  "defaultInputType", "priorityInputTypes", "inputTypeEvents", "internalPullups", "inputs",
+  "defaultOutputType", "outputs"
+};
+
+// ArduinoJson reader/writer for the config cache
+struct EepromWriter
+{
+  int address;
+  int end;
+
+  size_t write(uint8_t c)
+  {
+    if (address >= end) return 0;
+    EEPROM.write(address++, c);
+    return 1;
+  }
+
+  size_t write(const uint8_t * buffer, size_t length)
+  {
+    size_t count = 0;
+    while (count < length && write(buffer[count])) { count++; }
+    return count;
+  }
+};
+
+struct EepromReader
+{
+  int address;
+  int end;
+
+  int read()
+  {
+    return address < end ? EEPROM.read(address++) : -1;
+  }
+
+  size_t readBytes(char * buffer, size_t length)
+  {
+    size_t count = 0;
+    while (count < length && address < end) { buffer[count++] = EEPROM.read(address++); }
+    return count;
+  }
+};
+
+uint32_t eepromChecksum(int address, size_t length)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < length; i++)
+  {
+    hash = (hash ^ EEPROM.read(address + i)) * 16777619UL;
+  }
+  return hash;
+}
+
+bool loadConfigCache(JsonDocument & json)
+{
+  config_cache_header_t header;
+  EEPROM.get(CONFIG_CACHE_ADDRESS, header);
+
+  int data = CONFIG_CACHE_ADDRESS + sizeof(config_cache_header_t);
+  if (header.magic != CONFIG_CACHE_MAGIC || header.length > CONFIG_CACHE_SIZE || header.checksum != eepromChecksum(data, header.length))
+    return false;
+
+  EepromReader reader = { data, data + header.length };
+  return !deserializeMsgPack(json, reader);
+}
+
+void cacheConfig()
+{
+  config_cache_header_t header;
+  memset(&header, 0, sizeof(config_cache_header_t));
+
+  int data = CONFIG_CACHE_ADDRESS + sizeof(config_cache_header_t);
+  size_t length = measureMsgPack(g_config_stash);
+  if (length > CONFIG_CACHE_SIZE)
+  {
+    // Better no cache than a stale one
+    logger.println(F("[stio] config too large to cache"));
+  }
+  else
+  {
+    EepromWriter writer = { data, data + CONFIG_CACHE_SIZE };
+    serializeMsgPack(g_config_stash, writer);
+
+    header.magic = CONFIG_CACHE_MAGIC;
+    header.length = length;
+    header.checksum = eepromChecksum(data, length);
+  }
+
+  // Only actually written to flash if anything changed
+  EEPROM.put(CONFIG_CACHE_ADDRESS, header);
+  EEPROM.commit();
+}
+
+void stashIndexedConfig(JsonVariant stash, JsonArray entries)
+{
+  if (!stash.is<JsonArray>())
+  {
+    stash.to<JsonArray>();
+  }
+
+  // Each entry replaces the options we have for its index, any options it
+  // leaves out keep their stashed value (as they do on the device)
+  for (JsonVariant entry : entries)
+  {
+    if (!entry.containsKey("index"))
+      continue;
+
+    uint16_t index = entry["index"].as<uint16_t>();
+
+    JsonVariant stashed;
+    for (JsonVariant candidate : stash.as<JsonArray>())
+    {
+      if (candidate["index"].as<uint16_t>() == index)
+      {
+        stashed = candidate;
+        break;
       }
     }
+
+    if (stashed.isNull())
+    {
+      stash.add(entry);
+      continue;
+    }
+
+    for (JsonPair option : entry.as<JsonObject>())
+    {
+      stashed[option.key()] = option.value();
+    }
+  }
+}
+
+void stashConfig(JsonVariant json)
+{
+  if (g_config_source != CONFIG_FROM_OXRS)
+    return;
+
+  // Merge the I/O options from this config into the stash, a config may only
+  // carry some of them (e.g. a single input from a conf topic) so anything it
+  // leaves out keeps its stashed value
+  bool stashed = false;
+  for (const char * key : CONFIG_CACHE_KEYS)
+  {
+    if (!json.containsKey(key))
+      continue;
+
+    if ((strcmp(key, "inputs") == 0 || strcmp(key, "outputs") == 0) && json[key].is<JsonArray>())
+    {
+      stashIndexedConfig(g_config_stash[key], json[key].as<JsonArray>());
+    }
+    else
+    {
+      g_config_stash[key] = json[key];
+    }
+    stashed = true;
   }
+
+  // Nothing I/O related in this config
+  if (!stashed)
+    return;
+
+  cacheConfig();
 }
 
 void jsonConfig(JsonVariant json)
 {
+  uint8_t outputStart = g_mcp_output_start;
+  uint8_t outputPins = g_mcp_output_pins;
+
   if (json.containsKey("ioConfig"))
   {
     jsonIoConfig(json["ioConfig"]);
   }
   
-  if (json.containsKey("outputsPerMcp"))
+  if (json.containsKey("outputsPerMcp") && Layout::configurable())
   {
     g_mcp_output_pins = json["outputsPerMcp"].as<uint8_t>();
   }
 
+  // Keep running with the layout we started with (it is still cached below,
+  // so the new one is picked up at the next boot)
+  if (g_io_layout_locked && (g_mcp_output_start != outputStart || g_mcp_output_pins != outputPins))
+  {
+    logger.println(F("[stio] I/O layout change needs a restart"));
+    g_mcp_output_start = outputStart;
+    g_mcp_output_pins = outputPins;
+  }
+
+  if (json.containsKey("ntpServer") && !json["ntpServer"].isNull())
+  {
+    // Take a copy since SNTP keeps a reference to the server name
+    strncpy(g_ntp_server, json["ntpServer"].as<const char *>(), sizeof(g_ntp_server) - 1);
+#if defined(WIFI_MODE)
+    configTime(0, 0, g_ntp_server);
+#else
+    // Resolve the server again and sync straight away
+    g_ntp_ip = IPAddress();
+    g_ntp_interval_ms = 0;
+#endif
+  }
+
+  if (json.containsKey("udpMulticast"))
+  {
+    jsonUdpMulticast(json["udpMulticast"]);
+  }
+
+  if (json.containsKey("retainedState"))
+  {
+    g_retained_state = json["retainedState"].as<bool>();
+
+    // The state image is only allocated once first enabled
+    if (g_retained_state && !g_retained_state_image)
+    {
+      g_retained_state_image = (retained_state_t *)calloc(MCP_COUNT * MCP_PIN_COUNT, sizeof(retained_state_t));
+      if (!g_retained_state_image)
+      {
+        logger.println(F("[stio] no memory for retained state topics"));
+        g_retained_state = false;
+      }
+    }
+
+    // Seed every topic when (re)enabled
+    g_retained_state_seed = g_retained_state;
+  }
+
+  if (json.containsKey("i2cClockSpeed"))
+  {
+    g_i2c_clock_max = json["i2cClockSpeed"].isNull() ? I2C_CLOCK_SPEED : json["i2cClockSpeed"].as<uint32_t>();
+
+    // Re-calibrate if the bus is already up and running, unless we are just
+    // re-applying a config (which would undo any step down since)
+    bool replay = g_config_source == CONFIG_FROM_CACHE || g_config_source == CONFIG_FROM_STASH;
+    if (g_i2c_clock != 0 && !replay)
+    {
+      calibrateI2CBus();
+    }
+  }
+
+#if defined(LCD_ENABLED)
+  if (json.containsKey("lcdRefreshMs"))
+  {
+    g_lcd_refresh_ms = json["lcdRefreshMs"].isNull() ? LCD_REFRESH_MS : json["lcdRefreshMs"].as<uint32_t>();
+  }
+#endif
+
   if (json.containsKey("defaultInputType"))
   {
     uint8_t inputType = parseInputType(json["defaultInputType"]);
@@ -761,6 +2576,21 @@ void jsonConfig(JsonVariant json)
     }
   }
 
+  if (json.containsKey("priorityInputTypes"))
+  {
+    jsonPriorityInputTypes(json["priorityInputTypes"]);
+  }
+
+  if (json.containsKey("inputTypeEvents"))
+  {
+    jsonInputTypeEvents(json["inputTypeEvents"]);
+  }
+
+  if (json.containsKey("internalPullups"))
+  {
+    setDefaultInputPullup(json["internalPullups"].isNull() ? MCP_INTERNAL_PULLUPS : json["internalPullups"].as<bool>());
+  }
+
   if (json.containsKey("inputs"))
   {
     for (JsonVariant input : json["inputs"].as<JsonArray>())
@@ -786,6 +2616,41 @@ void jsonConfig(JsonVariant json)
       jsonOutputConfig(output);
     }
   }  
+
+  // Keep a copy of the I/O config to re-apply to any MCPs which turn up
+  // later, and for next boot
+  stashConfig(json);
+}
+
+bool applyCachedConfig()
+{
+  // Load straight into the stash, so partial configs received later are
+  // merged over the cached one rather than replacing it
+  if (!loadConfigCache(g_config_stash))
+  {
+    g_config_stash.clear();
+    return false;
+  }
+
+  g_config_source = CONFIG_FROM_CACHE;
+  jsonConfig(g_config_stash.as<JsonVariant>());
+  g_config_source = CONFIG_FROM_OXRS;
+
+  return true;
+}
+
+bool reapplyConfig()
+{
+  // Use the config received since boot if we have it, otherwise whatever
+  // made it into the cache
+  if (g_config_stash.size() == 0)
+    return applyCachedConfig();
+
+  g_config_source = CONFIG_FROM_STASH;
+  jsonConfig(g_config_stash.as<JsonVariant>());
+  g_config_source = CONFIG_FROM_OXRS;
+
+  return true;
 }
 
 void inputCommandSchema(JsonVariant json)
@@ -835,13 +2700,53 @@ void outputCommandSchema(JsonVariant json)
   required.add("command");
 }
 
+void eventCommandSchema(JsonVariant json)
+{
+  JsonObject replayEvents = json["replayEvents"].to<JsonObject>();
+  replayEvents["title"] = "Replay Events";
+  replayEvents["description"] = "Re-publish recent events by sequence number, e.g. to fill a gap detected by a consumer. Only the most recent events are kept in memory, anything older is reported as missing. Replays up to the latest event if 'to' is not specified. Sequence numbers restart every boot, if 'boot' is specified and doesn't match the current boot the whole range is reported as missing.";
+  replayEvents["type"] = "object";
+
+  JsonObject properties = replayEvents["properties"].to<JsonObject>();
+
+  JsonObject from = properties["from"].to<JsonObject>();
+  from["title"] = "From Sequence Number";
+  from["type"] = "integer";
+  from["minimum"] = 1;
+
+  JsonObject to = properties["to"].to<JsonObject>();
+  to["title"] = "To Sequence Number";
+  to["type"] = "integer";
+  to["minimum"] = 1;
+
+  JsonObject boot = properties["boot"].to<JsonObject>();
+  boot["title"] = "Boot Id";
+  boot["type"] = "integer";
+  boot["minimum"] = 1;
+
+  JsonArray required = replayEvents["required"].to<JsonArray>();
+  required.add("from");
+}
+
+void i2cCommandSchema(JsonVariant json)
+{
+  JsonObject queryI2CStats = json["queryI2CStats"].to<JsonObject>();
+  queryI2CStats["title"] = "Query I2C Stats";
+  queryI2CStats["description"] = "Publish the I2C transactions, bytes, errors, retries and cumulative bus time for each I/O buffer.";
+  queryI2CStats["type"] = "boolean";
+
+  JsonObject resetI2CStats = json["resetI2CStats"].to<JsonObject>();
+  resetI2CStats["title"] = "Reset I2C Stats";
+  resetI2CStats["type"] = "boolean";
+}
+
 /**
   Command handler
  */
 void setCommandSchema()
 {
   // Define our config schema
-  JsonDocument json;
+  JsonDocument json(&g_schema_arena);
   JsonVariant command = json.as<JsonVariant>();
 
   // Do we have any input MCPs?
@@ -856,116 +2761,106 @@ void setCommandSchema()
     outputCommandSchema(command);
   }
 
+  eventCommandSchema(command);
+  i2cCommandSchema(command);
+
   // Pass our command schema down to the Rack32 library
   oxrs.setCommandSchema(command);
 }
 
-void publishOutputEvent(uint8_t index, uint8_t type, uint8_t state)
+event_t * createEvent(bool output, uint16_t index, uint8_t type, uint8_t state, uint64_t timestamp)
 {
-  char outputType[8];
-  getOutputType(outputType, type);
-  char eventType[7];
-  getOutputEventType(eventType, type, state);
+  // Assign the next sequence number and keep a copy in case of replays
+  g_event_seq++;
+
+  event_t * event = &g_event_ring[g_event_seq % EVENT_RING_SIZE];
+  event->seq = g_event_seq;
+  event->timestamp = timestamp;
+  event->index = index;
+  event->type = type;
+  event->state = state;
+  event->output = output;
+  event->suppressed = 0;
+
+  return event;
+}
 
-  JsonDocument json;
-  json["index"] = index;
-  json["type"] = outputType;
-  json["event"] = eventType;
-  
-  if (!oxrs.publishStatus(json.as<JsonVariant>()))
+void addEventSequence(JsonVariant json, const event_t & event, bool replay)
+{
+  // Retained state payloads aren't a sequenced event
+  if (event.seq > 0)
   {
-    Serial.print(F("[stio] [failover] "));
-    serializeJson(json, Serial);
-    Serial.println();
+    json["seq"] = event.seq;
+  }
+  json["boot"] = g_boot_id;
 
-    // TODO: add failover handling code here
+  if (replay)
+  {
+    json["replay"] = true;
   }
 }
 
-void jsonOutputCommand(JsonVariant json)
+void buildOutputEvent(JsonVariant json, const event_t & event, bool replay)
 {
-  uint8_t index = getOutputIndex(json);
-  if (index == 0) return;
+  char outputType[8];
+  getOutputType(outputType, event.type);
+  char eventType[7];
+  getOutputEventType(eventType, event.type, event.state);
 
-  // Work out the MCP and pin we are processing
-  uint8_t mcp = outpIndex2Mcp(index);
-  uint8_t pin = outpIndex2Pin(index);
-  
-  // Get the output type for this pin
-  uint8_t type = oxrsOutput[mcp].getType(pin);
-  
-  if (json.containsKey("type"))
-  {
-    if (parseOutputType(json["type"]) != type)
-    {
-      oxrs.println(F("[stio] command type doesn't match configured type"));
-      return;
-    }
-  }
-  
-  if (json.containsKey("command"))
-  {
-    if (json["command"].isNull() || strcmp(json["command"], "query") == 0)
-    {
-      // Publish a status event with the current state
-      uint8_t state = mcp23017[mcp].digitalRead(pin);
-      publishOutputEvent(index, type, state);
-    }
-    else
-    {
-      // Send this command down to our output handler to process
-      if (strcmp(json["command"], "on") == 0)
-      {
-        oxrsOutput[mcp].handleCommand(mcp, pin, RELAY_ON);
-      }
-      else if (strcmp(json["command"], "off") == 0)
-      {
-        oxrsOutput[mcp].handleCommand(mcp, pin, RELAY_OFF);
-      }
-      else 
-      {
-        oxrs.println(F("[stio] invalid command"));
-      }
-    }
-  }
+  json["index"] = event.index;
+  json["type"] = outputType;
+  json["event"] = eventType;
+  addEventTimestamp(json, event.timestamp);
+  addEventSequence(json, event, replay);
 }
 
-void jsonCommand(JsonVariant json)
+void publishOutputEvent(const event_t & event, bool replay)
 {
-  if (json.containsKey("queryInputs"))
+  JsonDocument json(&g_event_arena);
+  buildOutputEvent(json.as<JsonVariant>(), event, replay);
+  
+  if (!publishStatus(json.as<JsonVariant>()))
   {
-    g_queryInputs = json["queryInputs"].as<bool>();
-  }
+    Serial.print(F("[stio] [failover] "));
+    serializeJson(json, Serial);
+    Serial.println();
 
-  if (json.containsKey("outputs"))
-  {
-    for (JsonVariant output : json["outputs"].as<JsonArray>())
-    {
-      jsonOutputCommand(output);
-    }
+    // TODO: add failover handling code here
   }
 }
 
-
-void publishInputEvent(uint8_t index, uint8_t type, uint8_t state)
+void buildInputEvent(JsonVariant json, const event_t & event, bool replay)
 {
   // Calculate the port and channel for this index (all 1-based)
-  uint8_t port = ((index - 1) / 4) + 1;
-  uint8_t channel = index - ((port - 1) * 4);
+  uint16_t port = ((event.index - 1) / 4) + 1;
+  uint8_t channel = event.index - ((port - 1) * 4);
 
   char inputType[9];
-  getInputType(inputType, type);
+  getInputType(inputType, event.type);
   char eventType[8];
-  getInputEventType(eventType, type, state);
+  getInputEventType(eventType, event.type, event.state);
 
-  JsonDocument json;
   json["port"] = port;
   json["channel"] = channel;
-  json["index"] = index;
+  json["index"] = event.index;
   json["type"] = inputType;
   json["event"] = eventType;
+  addEventTimestamp(json, event.timestamp);
+  addEventSequence(json, event, replay);
+
+  // Summary of a chattering input, i.e. the last of N rate limited events
+  if (event.suppressed > 0)
+  {
+    json["suppressed"] = event.suppressed;
+  }
+}
+
+void publishInputEvent(const event_t & event, bool replay)
+{
+  JsonDocument json(&g_event_arena);
+  buildInputEvent(json.as<JsonVariant>(), event, replay);
 
-  if (!oxrs.publishStatus(json.as<JsonVariant>()))
+  if (!publishStatus(json.as<JsonVariant>()))
   {
     Serial.print(F("[stio] [failover] "));
     serializeJson(json, Serial);
@@ -975,151 +2870,1696 @@ void publishInputEvent(uint8_t index, uint8_t type, uint8_t state)
   }
 }
 
-/**
-  Event handlers
-*/
-void inputEvent(uint8_t id, uint8_t input, uint8_t type, uint8_t state)
+bool isBistableInput(uint8_t type)
 {
-  // Determine the index for this input event (1-based)
-  uint8_t mcp = id;
-  uint8_t index = (MCP_PIN_COUNT * mcp) + input + 1;
-
-  // Publish the event
-  publishInputEvent(index, type, state);
+  return type == CONTACT || type == SECURITY || type == SWITCH;
 }
 
-void outputEvent(uint8_t id, uint8_t output, uint8_t type, uint8_t state)
+void updateRetainedState(bool output, uint16_t index, uint8_t type, uint8_t state, uint64_t timestamp)
 {
-  // Determine the index (1-based)
-  uint8_t mcp = id;
-  uint8_t pin = output;
-  uint8_t raw_index = (mcp - g_mcp_output_start) * g_mcp_output_pins + getMinOutputIndex() - 1 + pin;
-  uint8_t index = raw_index + 1;
-  
-  // Update the MCP pin - i.e. turn the relay on/off (LOW/HIGH)
-  mcp23017[mcp].digitalWrite(pin, state);
+  // Called for every state change, before any filtering, rate limiting or
+  // queueing, so the retained image is always current
+  if (!g_retained_state)
+    return;
 
-  // Publish the event
-  publishOutputEvent(index, type, state);
-}
+  // Only bi-stable inputs and outputs have a state worth retaining
+  if (!output && !isBistableInput(type))
+    return;
 
+  retained_state_t * retained = &g_retained_state_image[index - 1];
+  retained->timestamp = timestamp;
+  retained->type = type;
+  retained->state = state;
 
-/**
-  I2C
- */
-void configureI2CBus()
-{
-  oxrs.println(F("[stio] configuring I/O buffers..."));
+  if (!retained->dirty)
+  {
+    retained->dirty = true;
+    g_retained_state_pending++;
+  }
+}
 
+void seedRetainedStates()
+{
+  // Take the input states straight from the handlers - while seeding their
+  // query callbacks only update the retained image, nothing is published to
+  // the stat topic (see inputEvent)
+  g_retained_state_seeding = true;
   for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
   {
-    oxrs.print(F(" - 0x"));
-    oxrs.print(MCP_I2C_ADDRESS[mcp], HEX);
-    oxrs.print(F("..."));
-
-    // Check if an MCP was found on this address
-    if (bitRead(g_mcps_found, mcp))
+    if (oxrsInput[mcp] && bitRead(g_mcps_online, mcp))
     {
-      // If an MCP23017 was found then initialise
-      mcp23017[mcp].begin_I2C(MCP_I2C_ADDRESS[mcp]);
+      oxrsInput[mcp]->queryAll(mcp);
+    }
+  }
+  g_retained_state_seeding = false;
 
-      if (isInputMcp(mcp))
-      {     
-        // Configure input devices
-        for (uint8_t pin = 0; pin < MCP_PIN_COUNT; pin++)
-        {
-          mcp23017[mcp].pinMode(pin, MCP_INTERNAL_PULLUPS ? INPUT_PULLUP : INPUT);
-        }
-        oxrs.print(F("MCP23017 [input]"));
-        if (MCP_INTERNAL_PULLUPS) { oxrs.print(F(" (internal pullups)")); }
-        oxrs.println();
-      }
-      else
+  // And snapshot all the outputs
+  for (uint8_t mcp = Layout::outputStart(); mcp < MCP_COUNT; mcp++)
+  {
+    if (!oxrsOutput[mcp])
+      continue;
+
+    for (uint8_t pin = 0; pin < Layout::outputPins(); pin++)
+    {
+      uint16_t index = (mcp - Layout::outputStart()) * Layout::outputPins() + getMinOutputIndex() + pin;
+      updateRetainedState(true, index, oxrsOutput[mcp]->getType(pin), bitRead(g_mcp_olat[mcp], pin), getMicros());
+    }
+  }
+}
+
+void publishRetainedState(const event_t & event)
+{
+  char topic[64];
+  oxrs.getMQTT()->getStatusTopic(topic);
+  snprintf_P(&topic[strlen(topic)], sizeof(topic) - strlen(topic), PSTR("/%s/%u"), event.output ? "output" : "input", event.index);
+
+  JsonDocument json(&g_event_arena);
+  if (event.output)
+  {
+    buildOutputEvent(json.as<JsonVariant>(), event, false);
+  }
+  else
+  {
+    buildInputEvent(json.as<JsonVariant>(), event, false);
+  }
+
+  oxrs.getMQTT()->publish(json.as<JsonVariant>(), topic, true);
+}
+
+void publishRetainedStates()
+{
+  if (!g_retained_state)
+    return;
+
+  // Seed every topic when enabled and whenever MQTT (re)connects, so new
+  // subscribers can always bootstrap from the broker
+  static bool connected = false;
+  bool wasConnected = connected;
+  connected = oxrs.getMQTT()->connected();
+  if (!connected)
+    return;
+
+  if (!wasConnected || g_retained_state_seed)
+  {
+    g_retained_state_seed = false;
+    seedRetainedStates();
+  }
+
+  // Publish the latest state of anything which has changed, a few per loop
+  static uint16_t next = 0;
+  uint8_t budget = RETAINED_STATE_BUDGET;
+  for (uint16_t i = 0; i < MCP_COUNT * MCP_PIN_COUNT && g_retained_state_pending > 0 && budget > 0; i++)
+  {
+    uint16_t index = next;
+    next = (next + 1) % (MCP_COUNT * MCP_PIN_COUNT);
+
+    retained_state_t * retained = &g_retained_state_image[index];
+    if (!retained->dirty)
+      continue;
+
+    event_t event = {};
+    event.output = index + 1 >= getMinOutputIndex();
+    event.index = index + 1;
+    event.type = retained->type;
+    event.state = retained->state;
+    event.timestamp = retained->timestamp;
+    publishRetainedState(event);
+
+    retained->dirty = false;
+    g_retained_state_pending--;
+    budget--;
+  }
+}
+
+void publishEvent(const event_t & event, bool replay)
+{
+  if (event.output)
+  {
+    publishOutputEvent(event, replay);
+  }
+  else
+  {
+    publishInputEvent(event, replay);
+  }
+}
+
+void putLittleEndian(uint8_t * buffer, uint64_t value, uint8_t bytes)
+{
+  for (uint8_t i = 0; i < bytes; i++)
+  {
+    buffer[i] = (value >> (i * 8)) & 0xFF;
+  }
+}
+
+bool startUdp()
+{
+  if (g_udp_port == 0)
+    return false;
+
+  // Start the UDP socket once the network is up, joining the multicast group
+  // so we can receive commands (and so the W5500 can send to the group) - on
+  // WiFi we only join if we are accepting commands, sending doesn't need it
+  if (!g_udp_started)
+  {
+#if defined(WIFI_MODE) && defined(ESP8266)
+    g_udp_started = g_udp_commands ? udp.beginMulticast(WiFi.localIP(), g_udp_group, g_udp_port) : udp.begin(g_udp_port);
+#elif defined(WIFI_MODE)
+    g_udp_started = g_udp_commands ? udp.beginMulticast(g_udp_group, g_udp_port) : udp.begin(g_udp_port);
+#else
+    g_udp_started = udp.beginMulticast(g_udp_group, g_udp_port);
+#endif
+  }
+
+  return g_udp_started;
+}
+
+void sendUdpEvent(const event_t * event)
+{
+  if (!startUdp())
+    return;
+
+  if (g_udp_format == UDP_FORMAT_MSGPACK)
+  {
+    JsonDocument json(&g_event_arena);
+    if (event->output)
+    {
+      buildOutputEvent(json.as<JsonVariant>(), *event, false);
+    }
+    else
+    {
+      buildInputEvent(json.as<JsonVariant>(), *event, false);
+    }
+
+    uint8_t payload[UDP_MSGPACK_SIZE];
+    size_t length = serializeMsgPack(json, payload, sizeof(payload));
+
+    if (length > 0 && udp.beginPacket(g_udp_group, g_udp_port))
+    {
+      udp.write(payload, length);
+      udp.endPacket();
+    }
+    return;
+  }
+
+  uint8_t frame[UDP_FRAME_SIZE];
+  frame[0] = UDP_FRAME_MAGIC;
+  frame[1] = UDP_FRAME_VERSION;
+  frame[2] = event->output ? 0x01 : 0x00;
+  frame[3] = event->type;
+  frame[4] = event->state;
+  putLittleEndian(&frame[5], event->index, 2);
+  putLittleEndian(&frame[7], event->seq, 4);
+  putLittleEndian(&frame[11], g_boot_id, 4);
+  putLittleEndian(&frame[15], event->timestamp, 8);
+
+  if (udp.beginPacket(g_udp_group, g_udp_port))
+  {
+    udp.write(frame, sizeof(frame));
+    udp.endPacket();
+  }
+}
+
+void publishQueuedEvent(uint8_t priority)
+{
+  // Publish the event at the head of this lane
+  event_queue_t * queue = &g_event_queue[priority];
+  publishEvent(queue->events[queue->head], false);
+  queue->head = (queue->head + 1) % EVENT_QUEUE_SIZE;
+  queue->count--;
+}
+
+void queueEvent(const event_t * event)
+{
+  // Send straight to any local UDP listeners (no need to wait in the queue)
+  sendUdpEvent(event);
+
+  // Output events are always normal priority
+  uint8_t priority = EVENT_PRIORITY_NORMAL;
+  if (!event->output && bitRead(g_priority_input_types, event->type))
+  {
+    priority = EVENT_PRIORITY_HIGH;
+  }
+
+  // If this lane is full drop the event (it can still be replayed), unless
+  // this is a query/command burst, where we make room by publishing (any high
+  // priority events and then) the oldest event in the lane instead
+  event_queue_t * queue = &g_event_queue[priority];
+  if (queue->count == EVENT_QUEUE_SIZE)
+  {
+    if (!g_event_backpressure)
+    {
+      queue->overflows++;
+      return;
+    }
+
+    while (priority != EVENT_PRIORITY_HIGH && g_event_queue[EVENT_PRIORITY_HIGH].count > 0)
+    {
+      publishQueuedEvent(EVENT_PRIORITY_HIGH);
+    }
+    publishQueuedEvent(priority);
+  }
+
+  queue->events[(queue->head + queue->count) % EVENT_QUEUE_SIZE] = *event;
+  queue->count++;
+  queue->maxCount = max(queue->maxCount, queue->count);
+}
+
+void processEventQueues()
+{
+  // Publish all high priority events, then a limited number of normal ones
+  for (uint8_t priority = 0; priority < EVENT_PRIORITY_COUNT; priority++)
+  {
+    event_queue_t * queue = &g_event_queue[priority];
+
+    uint8_t budget = priority == EVENT_PRIORITY_HIGH ? EVENT_QUEUE_SIZE : EVENT_NORMAL_BUDGET;
+    while (queue->count > 0 && budget-- > 0)
+    {
+      publishQueuedEvent(priority);
+    }
+  }
+}
+
+void replayEvents(JsonVariant json)
+{
+  if (!json.containsKey("from"))
+  {
+    logger.println(F("[stio] missing replay from"));
+    return;
+  }
+
+  // Replay up to the latest event if no end is specified
+  uint32_t from = json["from"].as<uint32_t>();
+  uint32_t to = json["to"].isNull() ? g_event_seq : json["to"].as<uint32_t>();
+  if (to > g_event_seq) { to = g_event_seq; }
+
+  if (from == 0 || from > to)
+  {
+    logger.println(F("[stio] invalid replay range"));
+    return;
+  }
+
+  // Events from a previous boot are gone, the sequence numbers now refer to
+  // different events
+  if (!json["boot"].isNull() && json["boot"].as<uint32_t>() != g_boot_id)
+  {
+    JsonDocument missing(&g_event_arena);
+    missing["replayMissing"]["boot"] = json["boot"].as<uint32_t>();
+    missing["replayMissing"]["from"] = from;
+    missing["replayMissing"]["to"] = json["to"].isNull() ? from : json["to"].as<uint32_t>();
+    missing["replayMissing"]["currentBoot"] = g_boot_id;
+    publishStatus(missing.as<JsonVariant>());
+    return;
+  }
+
+  // Published a few at a time from the loop (replacing any replay still in
+  // progress, the consumer asks again for anything it is still missing)
+  g_replay_from = from;
+  g_replay_to = to;
+}
+
+void publishReplayedEvents()
+{
+  if (g_replay_from == 0)
+    return;
+
+  // Live events first
+  for (uint8_t priority = 0; priority < EVENT_PRIORITY_COUNT; priority++)
+  {
+    if (g_event_queue[priority].count > 0)
+      return;
+  }
+
+  // Let the consumer know about any events which have dropped out of our
+  // ring (including while the replay was in progress)
+  uint32_t oldest = g_event_seq > EVENT_RING_SIZE ? g_event_seq - EVENT_RING_SIZE + 1 : 1;
+  if (g_replay_from < oldest)
+  {
+    JsonDocument missing(&g_event_arena);
+    missing["replayMissing"]["boot"] = g_boot_id;
+    missing["replayMissing"]["from"] = g_replay_from;
+    missing["replayMissing"]["to"] = min(g_replay_to, oldest - 1);
+    publishStatus(missing.as<JsonVariant>());
+
+    g_replay_from = oldest;
+  }
+
+  uint8_t budget = REPLAY_BUDGET;
+  while (g_replay_from <= g_replay_to && budget-- > 0)
+  {
+    publishEvent(g_event_ring[g_replay_from % EVENT_RING_SIZE], true);
+    g_replay_from++;
+  }
+
+  if (g_replay_from > g_replay_to)
+  {
+    g_replay_from = 0;
+  }
+}
+
+void jsonOutputCommand(JsonVariant json)
+{
+  uint16_t index = getOutputIndex(json);
+  if (index == 0) return;
+
+  // Work out the MCP and pin we are processing
+  uint8_t mcp = outpIndex2Mcp(index);
+  uint8_t pin = outpIndex2Pin(index);
+
+  if (!oxrsOutput[mcp])
+  {
+    logger.println(F("[stio] output not present"));
+    return;
+  }
+  
+  // Get the output type for this pin
+  uint8_t type = oxrsOutput[mcp]->getType(pin);
+  
+  if (json.containsKey("type"))
+  {
+    if (parseOutputType(json["type"]) != type)
+    {
+      logger.println(F("[stio] command type doesn't match configured type"));
+      return;
+    }
+  }
+  
+  if (json.containsKey("command"))
+  {
+    if (json["command"].isNull() || strcmp(json["command"], "query") == 0)
+    {
+      // Publish a status event with the current state
+      uint8_t state = bitRead(g_mcp_olat[mcp], pin);
+      queueEvent(createEvent(true, index, type, state, getMicros()));
+    }
+    else
+    {
+      // Send this command down to our output handler to process
+      if (strcmp(json["command"], "on") == 0)
       {
-        // Configure output devices
-        for (uint8_t pin = 0; pin < MCP_PIN_COUNT; pin++)
-        {
-          mcp23017[mcp].pinMode(pin, OUTPUT);
-          mcp23017[mcp].digitalWrite(pin, RELAY_OFF);
-        }
-         oxrs.println(F("MCP23017 [output]"));
+        oxrsOutput[mcp]->handleCommand(mcp, pin, RELAY_ON);
       }
+      else if (strcmp(json["command"], "off") == 0)
+      {
+        oxrsOutput[mcp]->handleCommand(mcp, pin, RELAY_OFF);
+      }
+      else 
+      {
+        logger.println(F("[stio] invalid command"));
+      }
+    }
+  }
+}
+
+void jsonCommand(JsonVariant json)
+{
+  if (json.containsKey("queryInputs"))
+  {
+    g_queryInputs = json["queryInputs"].as<bool>();
+  }
+
+  if (json.containsKey("outputs"))
+  {
+    g_event_backpressure = true;
+    for (JsonVariant output : json["outputs"].as<JsonArray>())
+    {
+      jsonOutputCommand(output);
+    }
+    g_event_backpressure = false;
+  }
+
+  if (json.containsKey("replayEvents"))
+  {
+    replayEvents(json["replayEvents"]);
+  }
+
+  if (json.containsKey("queryI2CStats") && json["queryI2CStats"].as<bool>())
+  {
+    queryI2CStats();
+  }
+
+  if (json.containsKey("resetI2CStats") && json["resetI2CStats"].as<bool>())
+  {
+    resetI2CStats();
+  }
+}
+
+
+bool takeRateLimitToken(rate_limit_t * limit)
+{
+  // No rate limit configured
+  if (limit->rate == 0)
+    return true;
+
+  // Add a token for each interval since our last refill (up to a full bucket)
+  uint32_t interval = 1000 / limit->rate;
+  uint32_t tokens = (millis() - limit->refillMs) / interval;
+  if (tokens > 0)
+  {
+    limit->refillMs += tokens * interval;
+    limit->tokens = min(limit->tokens + tokens, (uint32_t)limit->rate);
+  }
+
+  if (limit->tokens == 0)
+    return false;
+
+  limit->tokens--;
+  return true;
+}
+
+void publishChatterSummary()
+{
+  // Only publish a summary every so often
+  static uint32_t lastSummary = 0;
+  if ((millis() - lastSummary) < CHATTER_SUMMARY_MS)
+    return;
+
+  lastSummary = millis();
+
+  // No rate limits configured
+  if (!g_input_rate_limit)
+    return;
+
+  for (uint16_t i = 0; i < MCP_COUNT * MCP_PIN_COUNT; i++)
+  {
+    rate_limit_t * limit = &g_input_rate_limit[i];
+    if (!limit->chattering)
+      continue;
+
+    if (!limit->recent)
+    {
+      // Nothing suppressed since our last summary so no longer chattering
+      limit->chattering = false;
+      continue;
+    }
+    limit->recent = false;
+
+    // If an event has been published since the last one we suppressed, the
+    // count went out with it (and the suppressed state is stale)
+    if (limit->suppressed == 0)
+      continue;
+
+    // Otherwise publish the last event we suppressed, which is the current
+    // state of the input, so the final state isn't lost
+    uint64_t now = getMicros();
+    uint64_t timestamp = now - (uint32_t)((uint32_t)now - limit->lastUs);
+    event_t * event = createEvent(false, i + 1, limit->lastType, limit->lastState, timestamp);
+    event->suppressed = limit->suppressed;
+    queueEvent(event);
+
+    limit->suppressed = 0;
+  }
+}
+
+/**
+  Event handlers
+*/
+bool isInputEventFiltered(uint16_t index, uint8_t type, uint8_t state)
+{
+  // Per input filters override the filter for the input type
+  uint32_t filter = g_input_event_filter[index - 1];
+  if (!(filter & INPUT_EVENT_FILTER_SET))
+  {
+    filter = g_input_type_event_filter[type];
+  }
+
+  if (filter == 0)
+    return false;
+
+  uint8_t code = getInputEventCode(type, state);
+  return code != INVALID_INPUT_EVENT && bitRead(filter, code);
+}
+
+void inputEvent(uint8_t id, uint8_t input, uint8_t type, uint8_t state)
+{
+  // Determine the index for this input event (1-based)
+  uint8_t mcp = id;
+  uint16_t index = (MCP_PIN_COUNT * mcp) + input + 1;
+
+  // Ignore any events while this MCP is settling after (re)initialisation
+  if (bitRead(g_mcps_untrusted, mcp))
+    return;
+
+  // Keep the retained state image current, even if this event is dropped
+  updateRetainedState(false, index, type, state, g_mcp_sample_us[mcp]);
+
+  // Just seeding the retained image, not a real event
+  if (g_retained_state_seeding)
+    return;
+
+  // Drop any events we have been configured not to publish, before they
+  // take a rate limit token or get anywhere near the JSON formatting
+  if (isInputEventFiltered(index, type, state))
+  {
+    g_input_events_filtered++;
+    return;
+  }
+
+  // Drop (but keep a count of) any events over our rate limit
+  rate_limit_t * limit = g_input_rate_limit ? &g_input_rate_limit[index - 1] : NULL;
+  if (limit && !takeRateLimitToken(limit))
+  {
+    if (limit->suppressed < UINT16_MAX) { limit->suppressed++; }
+    limit->lastUs = (uint32_t)g_mcp_sample_us[mcp];
+    limit->lastType = type;
+    limit->lastState = state;
+    limit->chattering = true;
+    limit->recent = true;
+    return;
+  }
+
+  // Queue the event for publishing (timestamped when the MCP was sampled),
+  // with a count of any suppressed before it
+  event_t * event = createEvent(false, index, type, state, g_mcp_sample_us[mcp]);
+  if (limit)
+  {
+    event->suppressed = limit->suppressed;
+    limit->suppressed = 0;
+  }
+  queueEvent(event);
+}
+
+void outputEvent(uint8_t id, uint8_t output, uint8_t type, uint8_t state)
+{
+  // Determine the index (1-based)
+  uint8_t mcp = id;
+  uint8_t pin = output;
+  uint16_t raw_index = (mcp - Layout::outputStart()) * Layout::outputPins() + getMinOutputIndex() - 1 + pin;
+  uint16_t index = raw_index + 1;
+  
+  // Update the MCP pin - i.e. turn the relay on/off (LOW/HIGH) - if the MCP
+  // is offline the latch image is restored when it is re-initialised
+  bitWrite(g_mcp_olat[mcp], pin, state);
+  if (bitRead(g_mcps_online, mcp) && !mcpWrite16(mcp, MCP_REG_OLAT, g_mcp_olat[mcp]))
+  {
+    mcpOffline(mcp);
+  }
+
+  // Keep the retained state image current
+  updateRetainedState(true, index, type, state, getMicros());
+
+  // Save the new state once things settle down (if persisted)
+  if (bitRead(g_mcp_persist[mcp], pin))
+  {
+    g_output_store_dirty = true;
+    g_output_store_changed_ms = millis();
+  }
+
+  // Queue the event for publishing
+  queueEvent(createEvent(true, index, type, state, getMicros()));
+}
+
+
+/**
+  I2C
+ */
+void scheduleI2CBus()
+{
+  // Build the scan order from the MCPs found, sorted by mux channel so
+  // each channel is only selected once per pass of the main loop (stable
+  // insertion sort, so MCPs on the same channel stay in slot order)
+  g_mcp_scan_count = 0;
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    if (bitRead(g_mcps_found, mcp) == 0)
+      continue;
+
+    uint8_t i = g_mcp_scan_count++;
+#if defined(I2C_MUX_ADDRESS)
+    while (i > 0 && MCP_I2C_CHANNEL[g_mcp_scan_order[i - 1]] > MCP_I2C_CHANNEL[mcp])
+    {
+      g_mcp_scan_order[i] = g_mcp_scan_order[i - 1];
+      i--;
+    }
+#endif
+    g_mcp_scan_order[i] = mcp;
+  }
+}
+
+bool configureMcp(uint8_t mcp)
+{
+  // Direction and polarity for both ports (IODIRA/B, IPOLA/B)
+  uint16_t iodir = getMcpIodir(mcp);
+  uint16_t ipol = isInputMcp(mcp) ? g_mcp_ipol[mcp] : 0x0000;
+  uint8_t config[4] = { (uint8_t)(iodir & 0xFF), (uint8_t)(iodir >> 8), (uint8_t)(ipol & 0xFF), (uint8_t)(ipol >> 8) };
+
+  bool ok;
+  if (isInputMcp(mcp))
+  {
+    // Configure input devices
+    ok = mcpWrite16(mcp, MCP_REG_GPPU, g_mcp_gppu[mcp]) &&
+         mcpWriteRegisters(mcp, MCP_REG_IODIR, config, sizeof(config));
+  }
+  else
+  {
+    // Configure output devices - restoring the output latch before enabling
+    // the outputs so relays come straight up in their last known state
+    ok = mcpWrite16(mcp, MCP_REG_OLAT, g_mcp_olat[mcp]) &&
+         mcpWrite16(mcp, MCP_REG_GPPU, 0x0000) &&
+         mcpWriteRegisters(mcp, MCP_REG_IODIR, config, sizeof(config));
+  }
+
+  if (!ok)
+    return false;
+
+  // Suppress input events until the input handler has settled
+  bitSet(g_mcps_online, mcp);
+  bitSet(g_mcps_untrusted, mcp);
+  g_mcp_settle_ms[mcp] = millis();
+
+  return true;
+}
+
+bool isMcpConfigured(uint8_t mcp)
+{
+  // Check an MCP hasn't been reset (e.g. power glitch) and lost its config
+  uint16_t iodir;
+  if (!mcpRead16(mcp, MCP_REG_IODIR, &iodir) || iodir != getMcpIodir(mcp))
+    return false;
+
+  if (isOutputMcp(mcp))
+    return true;
+
+  uint16_t ipol;
+  if (!mcpRead16(mcp, MCP_REG_IPOL, &ipol) || ipol != g_mcp_ipol[mcp])
+    return false;
+
+  uint16_t gppu;
+  if (!mcpRead16(mcp, MCP_REG_GPPU, &gppu))
+    return false;
+
+  return gppu == g_mcp_gppu[mcp];
+}
+
+void allocateHandlerArena()
+{
+  // One slot per MCP found, big enough for either role
+  uint8_t count = 0;
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    if (bitRead(g_mcps_found, mcp)) { count++; }
+  }
+
+  if (count == 0)
+    return;
+
+  g_handler_arena = (handler_slot_t *)malloc(count * sizeof(handler_slot_t));
+  g_handler_arena_size = g_handler_arena ? count : 0;
+}
+
+handler_slot_t * allocateHandlerSlot()
+{
+  if (g_handler_arena_used < g_handler_arena_size)
+    return &g_handler_arena[g_handler_arena_used++];
+
+  // MCPs hot-plugged since boot weren't counted when sizing the arena
+  handler_slot_t * slot = (handler_slot_t *)malloc(sizeof(handler_slot_t));
+  if (slot) { g_handler_heap_used++; }
+  return slot;
+}
+
+bool syncMcpHandlers()
+{
+  // Make sure each MCP found has a handler for the role it has in the
+  // current layout, returns true if any were (re)created
+  bool changed = false;
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    if (bitRead(g_mcps_found, mcp) == 0)
+      continue;
+
+    bool input = isInputMcp(mcp);
+    if (input ? oxrsInput[mcp] != NULL : oxrsOutput[mcp] != NULL)
+      continue;
+
+    if (!g_mcp_handler[mcp])
+    {
+      g_mcp_handler[mcp] = allocateHandlerSlot();
+    }
+
+    if (!g_mcp_handler[mcp])
+    {
+      logger.print(F("[stio] no memory for handler on I/O buffer "));
+      printMcpAddress(mcp);
+      logger.println();
+      continue;
+    }
+
+    // The slot is re-used if this MCP has changed role
+    if (oxrsInput[mcp])
+    {
+      oxrsInput[mcp]->~OXRS_Input();
+      oxrsInput[mcp] = NULL;
+    }
+
+    if (oxrsOutput[mcp])
+    {
+      oxrsOutput[mcp]->~OXRS_Output();
+      oxrsOutput[mcp] = NULL;
+    }
+
+    if (input)
+    {
+      // Initialise input handlers (default to SWITCH)
+      oxrsInput[mcp] = new (g_mcp_handler[mcp]) OXRS_Input();
+      oxrsInput[mcp]->begin(inputEvent, SWITCH);
+    }
+    else
+    {
+      // Initialise output handlers (default to RELAY)
+      oxrsOutput[mcp] = new (g_mcp_handler[mcp]) OXRS_Output();
+      oxrsOutput[mcp]->begin(outputEvent, RELAY);
+    }
+
+    changed = true;
+  }
+
+  return changed;
+}
+
+void printHandlerMemory()
+{
+  uint8_t inputs = 0, outputs = 0;
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    if (oxrsInput[mcp]) { inputs++; }
+    if (oxrsOutput[mcp]) { outputs++; }
+  }
+
+  // Compared to a static input and output handler for every MCP slot
+  uint32_t used = (g_handler_arena_size + g_handler_heap_used) * sizeof(handler_slot_t);
+  uint32_t fixed = MCP_COUNT * (sizeof(OXRS_Input) + sizeof(OXRS_Output));
+
+  logger.print(F("[stio] handlers for "));
+  logger.print(inputs);
+  logger.print(F(" input and "));
+  logger.print(outputs);
+  logger.print(F(" output MCPs using "));
+  logger.print(used);
+  logger.print(F(" bytes (saving "));
+  logger.print(fixed - used);
+  logger.println(F(" bytes)"));
+}
+
+void configureI2CBus()
+{
+  // Make sure we have the right handlers for the current layout, and
+  // re-apply the config to any new ones
+  if (syncMcpHandlers())
+  {
+    reapplyConfig();
+  }
+  printHandlerMemory();
+
+  logger.println(F("[stio] configuring I/O buffers..."));
+
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    logger.print(F(" - "));
+    printMcpAddress(mcp);
+    logger.print(F("..."));
+
+    // Check if an MCP was found on this address
+    if (bitRead(g_mcps_found, mcp) == 0)
+    {
+      logger.println(F("empty"));
+    }
+    else if (!configureMcp(mcp))
+    {
+      logger.println(F("MCP23017 [failed]"));
+    }
+    else if (isInputMcp(mcp))
+    {
+      logger.print(F("MCP23017 [input]"));
+      if (g_mcp_gppu[mcp]) { logger.print(F(" (internal pullups)")); }
+      logger.println();
+    }
+    else
+    {
+      logger.println(F("MCP23017 [output]"));
+    }
+  }
+}
+
+uint32_t loadI2CTopology()
+{
+  topology_t topology;
+  EEPROM.get(TOPOLOGY_ADDRESS, topology);
+
+  if (topology.magic != TOPOLOGY_MAGIC || topology.check != ~topology.mcps)
+    return 0;
+
+  return topology.mcps;
+}
+
+void putI2CTopology()
+{
+  topology_t topology = { TOPOLOGY_MAGIC, g_mcps_found, ~g_mcps_found };
+  EEPROM.put(TOPOLOGY_ADDRESS, topology);
+}
+
+void saveI2CTopology()
+{
+  // Only actually written to flash if anything changed
+  putI2CTopology();
+  EEPROM.commit();
+}
+
+bool verifyI2CTopology(uint32_t mcps)
+{
+  // Check every MCP found last time is still there, with a single register
+  // read each, rather than probing every address
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    uint16_t iodir;
+    if (bitRead(mcps, mcp) && !mcpRead16(mcp, MCP_REG_IODIR, &iodir))
+      return false;
+  }
+  return true;
+}
+
+void checkI2CBus()
+{
+  // Only check the bus every so often
+  static uint32_t lastCheck = 0;
+  if ((millis() - lastCheck) < I2C_REPROBE_MS)
+    return;
+
+  lastCheck = millis();
+
+  bool mcpsAdded = false;
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    if (bitRead(g_mcps_online, mcp))
+    {
+      if (isMcpConfigured(mcp))
+        continue;
+
+      logger.print(F("[stio] lost config on I/O buffer "));
+      printMcpAddress(mcp);
+      logger.println();
+      bitClear(g_mcps_online, mcp);
+    }
+
+    // Back off from MCPs which keep failing
+    if (g_mcp_probe_skip[mcp] > 0)
+    {
+      g_mcp_probe_skip[mcp]--;
+      continue;
+    }
+
+    // Check if anything has (re)appeared on this address
+    if (!mcpProbe(mcp))
+    {
+      backOffMcp(mcp);
+      continue;
+    }
+
+    logger.print(F("[stio] re-initialising I/O buffer "));
+    printMcpAddress(mcp);
+    logger.println();
+
+    if (!configureMcp(mcp))
+    {
+      backOffMcp(mcp);
+      continue;
+    }
+    g_mcp_probe_failures[mcp] = 0;
+
+    // Publish its inputs once settled, they may have changed while offline
+    bitSet(g_mcps_requery, mcp);
+
+    // Keep track of any new MCPs which weren't found at boot
+    if (bitRead(g_mcps_found, mcp) == 0)
+    {
+      bitSet(g_mcps_found, mcp);
+      mcpsAdded = true;
+    }
+  }
+
+  // Add any new MCPs to our scan and config/command schema, with handlers
+  // configured from the last config received (or the cached one)
+  if (mcpsAdded)
+  {
+    if (syncMcpHandlers())
+    {
+      reapplyConfig();
+    }
+    saveI2CTopology();
+    scheduleI2CBus();
+    setConfigSchema();
+    setCommandSchema();
+  }
+}
+
+void scanI2CBus()
+{
+  logger.println(F("[stio] scanning for I/O buffers..."));
+
+#if defined(I2C_MUX_ADDRESS)
+  // Check the mux is present and start with all channels deselected
+  Wire.beginTransmission(I2C_MUX_ADDRESS);
+  Wire.write(0);
+  bool muxFound = Wire.endTransmission() == 0;
+  g_mux_channel = I2C_MUX_NO_CHANNEL;
+#else
+  bool muxFound = true;
+#endif
+
+  // Use the MCPs found last time if they are all still there, any added
+  // since will be picked up by checkI2CBus()
+  uint32_t mcps = loadI2CTopology();
+  if (!muxFound)
+  {
+    // Without the mux we can't tell the channels apart, so don't probe (or
+    // overwrite the cached topology) - checkI2CBus() finds the MCPs once
+    // the mux answers
+    logger.println(F("[stio] no I2C mux found"));
+  }
+  else if (mcps != 0 && verifyI2CTopology(mcps))
+  {
+    logger.println(F("[stio] using cached topology"));
+    g_mcps_found = mcps;
+  }
+  else
+  {
+    for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+    {
+      // Check if there is anything responding on this address
+      if (mcpProbe(mcp))
+      {
+        bitWrite(g_mcps_found, mcp, 1);
+      }
+    }
+
+    // Written to flash along with the boot count, once the I/O is up
+    putI2CTopology();
+  }
+
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    // Initialise the output latch image (all outputs off)
+    g_mcp_olat[mcp] = (RELAY_OFF == LOW) ? 0x0000 : 0xFFFF;
+
+    // Initialise the input config (no inversion, default pull-ups)
+    g_mcp_ipol[mcp] = 0x0000;
+    g_mcp_gppu[mcp] = MCP_INTERNAL_PULLUPS ? 0xFFFF : 0x0000;
+  }
+
+  // Create handlers for the MCPs found
+  allocateHandlerArena();
+  syncMcpHandlers();
+
+  // Work out the order we will scan the MCPs found
+  scheduleI2CBus();
+}
+
+/**
+  UDP command handler
+ */
+void processUdpCommands()
+{
+  if (!startUdp())
+    return;
+
+  int length = udp.parsePacket();
+  if (length <= 0)
+    return;
+
+  // Not accepting commands, so discard anything received (each call to
+  // parsePacket() drops the previous packet)
+  if (!g_udp_commands)
+  {
+    uint8_t discarded = 1;
+    while (discarded < UDP_DISCARD_MAX && udp.parsePacket() > 0) { discarded++; }
+    return;
+  }
+
+  if (length > UDP_COMMAND_SIZE)
+  {
+    logger.println(F("[stio] udp command too large"));
+    return;
+  }
+
+  uint8_t payload[UDP_COMMAND_SIZE];
+  length = udp.read(payload, length);
+
+  // Ignore anything which isn't MessagePack (e.g. our own binary frames)
+  JsonDocument json(&g_event_arena);
+  if (deserializeMsgPack(json, payload, length))
+    return;
+
+  if (json.containsKey("config"))
+  {
+    // Partial configs, applied but not cached
+    g_config_source = CONFIG_FROM_UDP;
+    jsonConfig(json["config"]);
+    g_config_source = CONFIG_FROM_OXRS;
+  }
+
+  if (json.containsKey("command"))
+  {
+    jsonCommand(json["command"]);
+  }
+}
+
+/**
+  NTP client (Ethernet builds)
+ */
+#if !defined(WIFI_MODE)
+bool sendNtpRequest()
+{
+  if (!g_ntp_started)
+  {
+    g_ntp_started = ntpUdp.begin(NTP_LOCAL_PORT);
+    if (!g_ntp_started)
+      return false;
+  }
+
+  // Only resolve the server once, DNS blocks the loop until it answers
+  if ((uint32_t)g_ntp_ip == 0 && !g_ntp_ip.fromString(g_ntp_server))
+  {
+    DNSClient dns;
+    dns.begin(Ethernet.dnsServerIP());
+    if (dns.getHostByName(g_ntp_server, g_ntp_ip, NTP_DNS_TIMEOUT_MS) != 1)
+    {
+      logger.println(F("[stio] failed to resolve ntp server"));
+      g_ntp_ip = IPAddress();
+      return false;
     }
-    else
+  }
+
+  // SNTP v3 client request, everything else zero
+  uint8_t packet[NTP_PACKET_SIZE];
+  memset(packet, 0, sizeof(packet));
+  packet[0] = 0x1B;
+
+  if (!ntpUdp.beginPacket(g_ntp_ip, NTP_PORT))
+    return false;
+
+  ntpUdp.write(packet, sizeof(packet));
+  return ntpUdp.endPacket();
+}
+
+void receiveNtpResponse()
+{
+  uint8_t packet[NTP_PACKET_SIZE];
+  if (ntpUdp.parsePacket() < NTP_PACKET_SIZE || ntpUdp.read(packet, sizeof(packet)) < NTP_PACKET_SIZE)
+    return;
+
+  // Only take the time from a server reply, which isn't a kiss-o'-death
+  if ((packet[0] & 0x07) != 4 || packet[1] == 0)
+    return;
+
+  // Transmit timestamp (seconds and fraction since 1900), plus half the
+  // round trip for the time it took to get to us
+  uint32_t seconds = ((uint32_t)packet[40] << 24) | ((uint32_t)packet[41] << 16) | ((uint32_t)packet[42] << 8) | packet[43];
+  uint32_t fraction = ((uint32_t)packet[44] << 24) | ((uint32_t)packet[45] << 16) | ((uint32_t)packet[46] << 8) | packet[47];
+  uint64_t us = (((uint64_t)fraction * 1000000) >> 32) + (uint64_t)(millis() - g_ntp_request_ms) * 500;
+
+  struct timeval now;
+  now.tv_sec = seconds - NTP_EPOCH_OFFSET + us / 1000000;
+  now.tv_usec = us % 1000000;
+  settimeofday(&now, NULL);
+
+  g_ntp_pending = false;
+  g_ntp_interval_ms = NTP_SYNC_MS;
+}
+
+void syncNtp()
+{
+  if (g_ntp_server[0] == 0)
+    return;
+
+  // Wait for the response to our last request (or give up on it)
+  if (g_ntp_pending)
+  {
+    receiveNtpResponse();
+    if (g_ntp_pending && (millis() - g_ntp_request_ms) >= NTP_TIMEOUT_MS)
+    {
+      g_ntp_pending = false;
+    }
+    return;
+  }
+
+  if ((millis() - g_ntp_last_ms) < g_ntp_interval_ms)
+    return;
+
+  // Try again in a minute unless we hear back
+  g_ntp_last_ms = millis();
+  g_ntp_interval_ms = NTP_RETRY_MS;
+
+  if (sendNtpRequest())
+  {
+    g_ntp_pending = true;
+    g_ntp_request_ms = millis();
+  }
+}
+#endif
+
+/**
+  Display
+ */
+#if defined(LCD_ENABLED)
+void syncLCDPins()
+{
+  // Catch the display up with any input config applied before it started
+  // (i.e. the cached config)
+  lockLCD();
+  for (uint8_t mcp = 0; mcp < LCD_MCP_COUNT; mcp++)
+  {
+    if (!oxrsInput[mcp])
+      continue;
+
+    for (uint8_t pin = 0; pin < MCP_PIN_COUNT; pin++)
     {
-      oxrs.println(F("empty"));
+      oxrs.getLCD()->setPinType(mcp, pin, oxrsInput[mcp]->getType(pin) == SECURITY ? PIN_TYPE_SECURITY : PIN_TYPE_DEFAULT);
+      oxrs.getLCD()->setPinDisabled(mcp, pin, oxrsInput[mcp]->getDisabled(pin));
     }
   }
+  unlockLCD();
 }
 
+void updateLCD(uint8_t mcp, uint16_t value)
+{
+  // Just post the latest value, it is rendered by the display task
+  portENTER_CRITICAL(&g_lcd_mailbox_lock);
+  g_lcd_value[mcp] = value;
+  if (g_lcd_rendered[mcp] != value || !bitRead(g_lcd_valid, mcp))
+  {
+    bitSet(g_lcd_pending, mcp);
+  }
+  portEXIT_CRITICAL(&g_lcd_mailbox_lock);
+}
 
-void scanI2CBus()
+void refreshLCD()
+{
+  // Take whatever has changed since we last looked
+  uint16_t value[LCD_MCP_COUNT];
+  portENTER_CRITICAL(&g_lcd_mailbox_lock);
+  uint8_t pending = g_lcd_pending;
+  for (uint8_t mcp = 0; mcp < LCD_MCP_COUNT; mcp++)
+  {
+    if (!bitRead(pending, mcp))
+      continue;
+
+    value[mcp] = g_lcd_value[mcp];
+    g_lcd_rendered[mcp] = value[mcp];
+  }
+  g_lcd_valid |= pending;
+  g_lcd_pending = 0;
+  portEXIT_CRITICAL(&g_lcd_mailbox_lock);
+
+  for (uint8_t mcp = 0; mcp < LCD_MCP_COUNT; mcp++)
+  {
+    if (!bitRead(pending, mcp))
+      continue;
+
+    lockLCD();
+    oxrs.getLCD()->process(mcp, value[mcp]);
+    unlockLCD();
+  }
+}
+
+void displayTask(void * parameter)
+{
+  for (;;)
+  {
+    // Anything changing in between is coalesced into a single redraw
+    vTaskDelay(pdMS_TO_TICKS(max(g_lcd_refresh_ms, (uint32_t)1)));
+    refreshLCD();
+  }
+}
+
+void startDisplayTask()
+{
+  g_lcd_mutex = xSemaphoreCreateRecursiveMutex();
+  xTaskCreatePinnedToCore(displayTask, "display", LCD_TASK_STACK, NULL, LCD_TASK_PRIORITY, NULL, LCD_TASK_CORE);
+}
+#endif
+
+/**
+  Telemetry
+ */
+uint32_t getMaxFreeBlock()
+{
+#if defined(OXRS_ROOM8266)
+  return ESP.getMaxFreeBlockSize();
+#else
+  return ESP.getMaxAllocHeap();
+#endif
+}
+
+// The ESP32 heap is split over several memory regions, so the largest
+// block is always well short of the total free and a fragmentation figure
+// based on them reads ~50% on a healthy unit - only the ESP8266 reports it
+#if defined(OXRS_ROOM8266)
+uint8_t getHeapFragmentation()
+{
+  return ESP.getHeapFragmentation();
+}
+#endif
+
+uint32_t getMinFreeHeap()
+{
+#if defined(OXRS_ROOM8266)
+  return g_heap_min_free;
+#else
+  return ESP.getMinFreeHeap();
+#endif
+}
+
+uint32_t getLoopStackFree()
+{
+  // Least free stack the loop task has had (called from the loop task)
+#if defined(OXRS_ROOM8266)
+  return ESP.getFreeContStack();
+#else
+  return uxTaskGetStackHighWaterMark(NULL);
+#endif
+}
+
+uint32_t getAllocFailures()
+{
+  // On the ESP32 every failure (including our arena fallbacks) reaches the
+  // heap callback, otherwise only our arenas can tell us
+#if defined(ESP32)
+  return g_heap_alloc_failures;
+#else
+  return g_event_arena.failures() + g_schema_arena.failures();
+#endif
+}
+
+#if defined(ESP32)
+void heapAllocFailed(size_t size, uint32_t caps, const char * function_name)
+{
+  // Called from inside the allocator, so just count it
+  g_heap_alloc_failures++;
+}
+#endif
+
+void logHeap()
+{
+  logger.print(F("[stio] heap free: "));
+  logger.print(ESP.getFreeHeap());
+  logger.print(F(", max block: "));
+  logger.print(getMaxFreeBlock());
+#if defined(OXRS_ROOM8266)
+  logger.print(F(", fragmentation: "));
+  logger.print(getHeapFragmentation());
+  logger.print(F("%"));
+#endif
+  logger.print(F(", loop stack free: "));
+  logger.println(getLoopStackFree());
+}
+
+const char * getHealthAlertName(uint8_t alert)
+{
+  switch (alert)
+  {
+    case HEALTH_ALERT_HEAP_FREE:  return "heapFree";
+    case HEALTH_ALERT_HEAP_BLOCK: return "heapMaxBlock";
+    case HEALTH_ALERT_HEAP_FRAG:  return "heapFragmentation";
+    case HEALTH_ALERT_STACK_FREE: return "loopStackFree";
+  }
+  return "unknown";
+}
+
+void updateHealthAlert(uint8_t alert, uint32_t value, uint32_t threshold, bool above)
+{
+  // Raise once when crossing the threshold, clear once clear of it by the
+  // hysteresis margin, so a value hovering around it doesn't spam alerts
+  uint32_t margin = (threshold * HEALTH_HYSTERESIS_PC) / 100;
+  bool raised = bitRead(g_health_alerts, alert);
+  bool breach = above ? value > threshold : value < threshold;
+  bool clear = above ? value + margin < threshold : value > threshold + margin;
+
+  if (raised ? !clear : !breach)
+    return;
+
+  bitWrite(g_health_alerts, alert, !raised);
+
+  JsonDocument json(&g_event_arena);
+  JsonObject healthAlert = json["healthAlert"].to<JsonObject>();
+  healthAlert["alert"] = getHealthAlertName(alert);
+  healthAlert["state"] = raised ? "cleared" : "raised";
+  healthAlert["value"] = value;
+  healthAlert["threshold"] = threshold;
+  publishStatus(json.as<JsonVariant>());
+
+  logger.print(F("[stio] health alert "));
+  logger.print(getHealthAlertName(alert));
+  logger.print(raised ? F(" cleared: ") : F(" raised: "));
+  logger.println(value);
+}
+
+void sampleHealth()
+{
+  // Cheap enough to leave on, but no need to do it every pass
+  static uint32_t lastSample = 0;
+  if ((millis() - lastSample) < HEALTH_SAMPLE_MS)
+    return;
+
+  lastSample = millis();
+
+  uint32_t freeHeap = ESP.getFreeHeap();
+#if defined(OXRS_ROOM8266)
+  if (freeHeap < g_heap_min_free) { g_heap_min_free = freeHeap; }
+#endif
+
+  updateHealthAlert(HEALTH_ALERT_HEAP_FREE, freeHeap, HEAP_FREE_ALERT, false);
+  updateHealthAlert(HEALTH_ALERT_HEAP_BLOCK, getMaxFreeBlock(), HEAP_BLOCK_ALERT, false);
+#if defined(OXRS_ROOM8266)
+  updateHealthAlert(HEALTH_ALERT_HEAP_FRAG, getHeapFragmentation(), HEAP_FRAG_ALERT, true);
+#endif
+  updateHealthAlert(HEALTH_ALERT_STACK_FREE, getLoopStackFree(), STACK_FREE_ALERT, false);
+}
+
+void addArenaTelemetry(JsonObject json, const JsonArena & arena)
+{
+  json["size"] = arena.size();
+  json["peak"] = arena.peak();
+  json["overflows"] = arena.overflows();
+}
+
+void publishTelemetry()
+{
+  // Only publish telemetry every so often
+  static uint32_t lastTelemetry = 0;
+  if ((millis() - lastTelemetry) < TELEMETRY_INTERVAL_MS)
+    return;
+
+  lastTelemetry = millis();
+
+  JsonDocument json(&g_schema_arena);
+  json["i2cClockSpeed"] = g_i2c_clock;
+
+  JsonObject eventQueues = json["eventQueues"].to<JsonObject>();
+  for (uint8_t priority = 0; priority < EVENT_PRIORITY_COUNT; priority++)
+  {
+    JsonObject queue = eventQueues[priority == EVENT_PRIORITY_HIGH ? "high" : "normal"].to<JsonObject>();
+    queue["maxDepth"] = g_event_queue[priority].maxCount;
+    queue["overflows"] = g_event_queue[priority].overflows;
+  }
+
+  JsonObject loopTime = json["loopTimeUs"].to<JsonObject>();
+  loopTime["avg"] = g_loop_count ? (uint32_t)(g_loop_total_us / g_loop_count) : 0;
+  loopTime["max"] = g_loop_max_us;
+  g_loop_count = 0;
+  g_loop_total_us = 0;
+  g_loop_max_us = 0;
+
+  #if defined(LCD_ENABLED)
+  JsonObject display = json["display"].to<JsonObject>();
+  display["lockWaitMaxUs"] = g_lcd_lock_wait_max_us;
+  display["publishUnlocked"] = g_lcd_publish_unlocked;
+  display["loopDeferred"] = g_lcd_loop_deferred;
+  g_lcd_lock_wait_max_us = 0;
+  #endif
+
+  JsonObject heap = json["heap"].to<JsonObject>();
+  uint32_t freeHeap = ESP.getFreeHeap();
+  heap["free"] = freeHeap;
+  heap["maxBlock"] = getMaxFreeBlock();
+#if defined(OXRS_ROOM8266)
+  heap["fragmentation"] = getHeapFragmentation();
+#endif
+  heap["minFree"] = getMinFreeHeap();
+  heap["allocFailures"] = getAllocFailures();
+  json["loopStackFree"] = getLoopStackFree();
+
+  JsonArray healthAlerts = json["healthAlerts"].to<JsonArray>();
+  for (uint8_t alert = 0; alert < HEALTH_ALERT_COUNT; alert++)
+  {
+    if (bitRead(g_health_alerts, alert))
+    {
+      healthAlerts.add(getHealthAlertName(alert));
+    }
+  }
+
+  JsonObject arenas = json["jsonArenas"].to<JsonObject>();
+  addArenaTelemetry(arenas["event"].to<JsonObject>(), g_event_arena);
+  addArenaTelemetry(arenas["schema"].to<JsonObject>(), g_schema_arena);
+
+  json["filteredInputEvents"] = g_input_events_filtered;
+  json["outputStateWrites"] = g_output_store_writes;
+  json["outputStateWriteBudget"] = g_output_store_tokens;
+
+  addI2CStats(json["i2cStats"].to<JsonArray>());
+
+  JsonArray chattering = json["chatteringInputs"].to<JsonArray>();
+  for (uint16_t i = 0; g_input_rate_limit && i < MCP_COUNT * MCP_PIN_COUNT; i++)
+  {
+    if (g_input_rate_limit[i].chattering)
+    {
+      chattering.add(i + 1);
+    }
+  }
+
+  publishTelemetry(json.as<JsonVariant>());
+}
+
+/**
+  Output persistence
+ */
+uint32_t outputStoreChecksum(const output_store_t * store)
 {
-  oxrs.println(F("[stio] scanning for I/O buffers..."));
+  // FNV-1a over everything but the checksum itself
+  const uint8_t * data = (const uint8_t *)store;
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < offsetof(output_store_t, checksum); i++)
+  {
+    hash = (hash ^ data[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+void buildOutputStore(output_store_t * store)
+{
+  memset(store, 0, sizeof(output_store_t));
+  store->magic = OUTPUT_STORE_MAGIC;
+  store->outputStart = Layout::outputStart();
+  store->outputPins = Layout::outputPins();
 
   for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
   {
-    // Check if there is anything responding on this address
-    Wire.beginTransmission(MCP_I2C_ADDRESS[mcp]);
-    if (Wire.endTransmission() == 0)
+    if (!isOutputMcp(mcp))
+      continue;
+
+    // Timers are never restored, the output handler wouldn't turn them off
+    uint16_t persist = g_mcp_persist[mcp];
+    for (uint8_t pin = 0; pin < MCP_PIN_COUNT; pin++)
     {
-      bitWrite(g_mcps_found, mcp, 1);
+      if (oxrsOutput[mcp] && oxrsOutput[mcp]->getType(pin) == TIMER)
+      {
+        bitClear(persist, pin);
+      }
     }
 
-    // Initialise input handlers (default to SWITCH)
-    oxrsInput[mcp].begin(inputEvent, SWITCH);
+    store->olat[mcp] = g_mcp_olat[mcp] & persist;
+    store->persist[mcp] = persist;
+  }
+
+  store->checksum = outputStoreChecksum(store);
+}
+
+void saveOutputState()
+{
+  // Wait until the persisted outputs have stopped changing
+  if (!g_output_store_dirty || (millis() - g_output_store_changed_ms) < OUTPUT_STORE_DELAY_MS)
+    return;
+
+  // And stay within our flash write budget (still dirty, so we save once
+  // it has refilled)
+  uint32_t refills = (millis() - g_output_store_refill_ms) / OUTPUT_STORE_REFILL_MS;
+  if (refills > 0)
+  {
+    g_output_store_refill_ms += refills * OUTPUT_STORE_REFILL_MS;
+    g_output_store_tokens = min(g_output_store_tokens + refills, (uint32_t)OUTPUT_STORE_BURST);
+  }
+
+  if (g_output_store_tokens == 0)
+    return;
+
+  g_output_store_dirty = false;
+
+  // Nothing to do if the persisted state hasn't actually changed
+  output_store_t store, stored;
+  buildOutputStore(&store);
+  EEPROM.get(0, stored);
+  if (memcmp(&store, &stored, sizeof(output_store_t)) == 0)
+    return;
+
+  EEPROM.put(0, store);
+  if (!EEPROM.commit())
+  {
+    logger.println(F("[stio] failed to save output state"));
+    return;
+  }
+
+  g_output_store_writes++;
+  g_output_store_tokens--;
+}
+
+void restoreOutputState()
+{
+  output_store_t store;
+  EEPROM.get(0, store);
+  if (store.magic != OUTPUT_STORE_MAGIC || store.checksum != outputStoreChecksum(&store) ||
+      store.outputStart > MCP_COUNT || (store.outputPins != 8 && store.outputPins != MCP_PIN_COUNT) ||
+      (!Layout::configurable() && (store.outputStart != Layout::outputStart() || store.outputPins != Layout::outputPins())))
+  {
+    Serial.println(F("[stio] no output state to restore"));
+    return;
+  }
+
+  // Assume the layout we saved with, the config will correct it if it
+  // has since changed (and the MCPs will be reconfigured anyway)
+  g_mcp_output_start = store.outputStart;
+  g_mcp_output_pins = store.outputPins;
+
+  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  {
+    g_mcp_persist[mcp] = store.persist[mcp];
+
+    if (!isOutputMcp(mcp) || g_mcp_persist[mcp] == 0)
+      continue;
 
-    // Initialise output handlers (default to RELAY)
-    oxrsOutput[mcp].begin(outputEvent, RELAY);
+    g_mcp_olat[mcp] = (g_mcp_olat[mcp] & ~g_mcp_persist[mcp]) | (store.olat[mcp] & g_mcp_persist[mcp]);
+
+    // Drive the outputs straight away rather than waiting for the network
+    if (bitRead(g_mcps_found, mcp))
+    {
+      configureMcp(mcp);
+    }
   }
+
+  Serial.println(F("[stio] output state restored"));
 }
 
 /**
   Setup
 */
+void countBoot()
+{
+  boot_count_t bootCount;
+  EEPROM.get(BOOT_COUNT_ADDRESS, bootCount);
+
+  if (bootCount.magic != BOOT_COUNT_MAGIC || bootCount.check != ~bootCount.count)
+  {
+    bootCount.count = 0;
+  }
+
+  // Skip 0 on wrap, so a boot id is never 0
+  g_boot_id = bootCount.count + 1;
+  if (g_boot_id == 0) { g_boot_id = 1; }
+
+  bootCount = { BOOT_COUNT_MAGIC, g_boot_id, ~g_boot_id };
+  EEPROM.put(BOOT_COUNT_ADDRESS, bootCount);
+  EEPROM.commit();
+
+  Serial.print(F("[stio] boot id "));
+  Serial.println(g_boot_id);
+}
+
+void logBootStage(const __FlashStringHelper * stage)
+{
+  static uint32_t lastMs = 0;
+  uint32_t now = millis();
+
+  Serial.print(F("[stio] boot: "));
+  Serial.print(stage);
+  Serial.print(F(" "));
+  Serial.print(now - lastMs);
+  Serial.print(F("ms (ready at "));
+  Serial.print(now);
+  Serial.println(F("ms)"));
+
+  lastMs = now;
+}
+
 void setup()
 {
-  // Start serial and let settle
+  // Start serial
   Serial.begin(SERIAL_BAUD_RATE);
-  delay(1000);
   Serial.println(F("[stio] starting up..."));
 
-  // Start the I2C bus
+  // Count any failed heap allocations from here on
+  #if defined(ESP32)
+  heap_caps_register_failed_alloc_callback(heapAllocFailed);
+  #endif
+
+  // Start the I2C bus (at up to 400kHz, all MCP23017s support fast-mode)
+  // and our persistent storage
   Wire.begin();
+  Wire.setClock(min(g_i2c_clock_max, (uint32_t)400000L));
+  EEPROM.begin(EEPROM_SIZE);
+
+  // Bring the I/O up before the network, so outputs are restored and the
+  // inputs configured within milliseconds of power-on rather than after DHCP
 
-  // Scan the I2C bus
+  // Scan the I2C bus and restore any persisted outputs
   scanI2CBus();
+  logBootStage(F("i2c scan"));
+  restoreOutputState();
+  logBootStage(F("output restore"));
 
-  // Start Rack32 hardware
-  oxrs.begin(jsonConfig, jsonCommand);
+  // Apply the I/O config cached last time (until the full config arrives)
+  applyCachedConfig();
+  logBootStage(F("cached config"));
 
-  // set up I2C-I/O buffers
+  // Set up I2C-I/O buffers
   configureI2CBus();
+  logBootStage(F("mcp config"));
 
   // Speed up I2C clock for faster scan rate (after bus scan)
-  Wire.setClock(I2C_CLOCK_SPEED);
+  calibrateI2CBus();
+  logBootStage(F("i2c calibration"));
+
+  // Count this boot (and save any new topology) only now the I/O is up, as
+  // it means a flash erase - but before any events, which carry the boot id
+  countBoot();
+  logBootStage(F("boot count"));
+
+  // Start Rack32 hardware (network, MQTT and the full config)
+  uint8_t outputStart = Layout::outputStart();
+  uint8_t outputPins = Layout::outputPins();
+  g_oxrs_ready = true;
+  oxrs.begin(jsonConfig, jsonCommand);
+  logBootStage(F("network"));
+
+  // Reconfigure if the I/O layout has changed since the config was cached
+  if (Layout::outputStart() != outputStart || Layout::outputPins() != outputPins)
+  {
+    configureI2CBus();
+    logBootStage(F("mcp reconfig"));
+  }
+  g_io_layout_locked = true;
+
+  // Set up port display (depends on the output start)
+  #if defined(LCD_ENABLED)
+  syncLCDPins();
 
-  // Set up port display (depends on g_mcp_output_start)
-  #if defined(OXRS_RACK32)
   bool err_output_start = false;
-  if (g_mcp_output_pins == 8)
+  uint8_t lcd_output_start = min(Layout::outputStart(), (uint8_t)LCD_MCP_COUNT);
+  uint8_t lcd_mcps_found = g_mcps_found & 0xFF;
+  if (Layout::outputPins() == 8)
   {
-    switch (g_mcp_output_start)
+    switch (lcd_output_start)
     {
     case 0:
-      oxrs.getLCD()->drawPorts(PORT_LAYOUT_OUTPUT_AUTO_8, g_mcps_found);
+      oxrs.getLCD()->drawPorts(PORT_LAYOUT_OUTPUT_AUTO_8, lcd_mcps_found);
       break;
     case 2:
-      oxrs.getLCD()->drawPorts(PORT_LAYOUT_IO_32_96_8, g_mcps_found);
+      oxrs.getLCD()->drawPorts(PORT_LAYOUT_IO_32_96_8, lcd_mcps_found);
       break;
     case 4:
-      oxrs.getLCD()->drawPorts(PORT_LAYOUT_IO_64_64_8, g_mcps_found);
+      oxrs.getLCD()->drawPorts(PORT_LAYOUT_IO_64_64_8, lcd_mcps_found);
       break;
     case 6:
-      oxrs.getLCD()->drawPorts(PORT_LAYOUT_IO_96_32_8, g_mcps_found);
+      oxrs.getLCD()->drawPorts(PORT_LAYOUT_IO_96_32_8, lcd_mcps_found);
       break;
     case 8:
-      oxrs.getLCD()->drawPorts(PORT_LAYOUT_INPUT_AUTO, g_mcps_found);
+      oxrs.getLCD()->drawPorts(PORT_LAYOUT_INPUT_AUTO, lcd_mcps_found);
       break;
     default:
       err_output_start = true;
@@ -1127,22 +4567,22 @@ void setup()
   }
   else
   {
-    switch (g_mcp_output_start)
+    switch (lcd_output_start)
     {
     case 0:
-      oxrs.getLCD()->drawPorts(PORT_LAYOUT_OUTPUT_AUTO, g_mcps_found);
+      oxrs.getLCD()->drawPorts(PORT_LAYOUT_OUTPUT_AUTO, lcd_mcps_found);
       break;
     case 2:
-      oxrs.getLCD()->drawPorts(PORT_LAYOUT_IO_32_96, g_mcps_found);
+      oxrs.getLCD()->drawPorts(PORT_LAYOUT_IO_32_96, lcd_mcps_found);
       break;
     case 4:
-      oxrs.getLCD()->drawPorts(PORT_LAYOUT_IO_64_64, g_mcps_found);
+      oxrs.getLCD()->drawPorts(PORT_LAYOUT_IO_64_64, lcd_mcps_found);
       break;
     case 6:
-      oxrs.getLCD()->drawPorts(PORT_LAYOUT_IO_96_32, g_mcps_found);
+      oxrs.getLCD()->drawPorts(PORT_LAYOUT_IO_96_32, lcd_mcps_found);
       break;
     case 8:
-      oxrs.getLCD()->drawPorts(PORT_LAYOUT_INPUT_AUTO, g_mcps_found);
+      oxrs.getLCD()->drawPorts(PORT_LAYOUT_INPUT_AUTO, lcd_mcps_found);
       break;
     default:
       err_output_start = true;
@@ -1150,14 +4590,20 @@ void setup()
   }
   if (err_output_start)
   {
-    oxrs.print(F("[stio] invalid g_mcp_output_start: "));
-    oxrs.println(g_mcp_output_start);
+    logger.print(F("[stio] invalid output start: "));
+    logger.println(Layout::outputStart());
   }
+
+  // Render port animations from now on
+  startDisplayTask();
   #endif
 
   // Set up config/command schema (for self-discovery and adoption)
   setConfigSchema();
   setCommandSchema();
+
+  // Log where the heap and stack stand once everything is up
+  logHeap();
 }
 
 /**
@@ -1165,43 +4611,151 @@ void setup()
 */
 void loop()
 {
-  // Let Rack32 hardware handle any events etc
+  // Keep track of how long each pass takes
+  static uint32_t lastLoopUs = micros();
+  uint32_t loopUs = micros() - lastLoopUs;
+  lastLoopUs += loopUs;
+  g_loop_count++;
+  g_loop_total_us += loopUs;
+  if (loopUs > g_loop_max_us) { g_loop_max_us = loopUs; }
+
+  // Let Rack32 hardware handle any events etc - this draws to the display,
+  // so is put off while the display task is rendering, and only waits for it
+  // once it has been put off too long (keep track of how long for)
+  #if defined(LCD_ENABLED)
+  static uint32_t lastOxrsLoop = millis();
+  bool locked = tryLockLCD();
+  if (!locked && (millis() - lastOxrsLoop) >= LCD_DEFER_MAX_MS)
+  {
+    uint32_t lockUs = micros();
+    lockLCD();
+    lockUs = micros() - lockUs;
+    if (lockUs > g_lcd_lock_wait_max_us) { g_lcd_lock_wait_max_us = lockUs; }
+    locked = true;
+  }
+
+  if (locked)
+  {
+    oxrs.loop();
+    unlockLCD();
+    lastOxrsLoop = millis();
+  }
+  else
+  {
+    g_lcd_loop_deferred++;
+  }
+  #else
   oxrs.loop();
+  #endif
 
-  // Iterate through each of the MCP23017s
-  for (uint8_t mcp = 0; mcp < MCP_COUNT; mcp++)
+  // Check for any I/O buffers which have been reset, removed or added
+  checkI2CBus();
+
+  // Step the I2C clock down if we are seeing too many errors
+  monitorI2CBus();
+
+  // Handle any commands received via UDP
+  processUdpCommands();
+
+  // Keep the wall clock for event timestamps in sync (WiFi builds use SNTP)
+  #if !defined(WIFI_MODE)
+  syncNtp();
+  #endif
+
+  // Publish a summary of any chattering inputs
+  publishChatterSummary();
+
+  // Publish any changes to the retained per-index state topics
+  publishRetainedStates();
+
+  // Keep an eye on the heap and stack, and publish any periodic telemetry
+  sampleHealth();
+  publishTelemetry();
+
+  // Save the state of any persisted outputs which have changed
+  saveOutputState();
+
+  // Iterate through each of the MCP23017s found
+#if defined(I2C_MUX_ADDRESS)
+  // Alternate the scan direction each pass so we start on the mux channel
+  // we finished on, saving a channel switch per pass
+  static bool reverse = false;
+  reverse = !reverse;
+#endif
+
+  for (uint8_t i = 0; i < g_mcp_scan_count; i++)
   {
-    if (bitRead(g_mcps_found, mcp) == 0)
-      continue;
+#if defined(I2C_MUX_ADDRESS)
+    uint8_t mcp = g_mcp_scan_order[reverse ? g_mcp_scan_count - 1 - i : i];
+#else
+    uint8_t mcp = g_mcp_scan_order[i];
+#endif
 
-    // Check for any output events
-    if (isOutputMcp(mcp))
+    // Check for any output events (timers keep running while offline)
+    if (oxrsOutput[mcp])
     {
-      oxrsOutput[mcp].process();
+      oxrsOutput[mcp]->process();
     }
 
+    // Ignore this MCP until it is re-initialised
+    if (bitRead(g_mcps_online, mcp) == 0)
+      continue;
+
     // Read the values for all 16 pins on this MCP
-    uint16_t io_value = mcp23017[mcp].readGPIOAB();
+    uint16_t io_value;
+    if (!mcpRead16Retry(mcp, MCP_REG_GPIO, &io_value))
+    {
+      mcpOffline(mcp);
+      continue;
+    }
+    g_mcp_sample_us[mcp] = getMicros();
 
-    // Show port animations
-    #if defined(OXRS_RACK32)
-    oxrs.getLCD()->process(mcp, io_value);
+    // Queue port animations (only redrawn on change)
+    #if defined(LCD_ENABLED)
+    if (mcp < LCD_MCP_COUNT)
+    {
+      updateLCD(mcp, io_value);
+    }
     #endif
     
     // Check for any input events
-    if (isInputMcp(mcp))
+    if (oxrsInput[mcp])
     {
       // Check for any input events
-      oxrsInput[mcp].process(mcp, io_value);
+      oxrsInput[mcp]->process(mcp, io_value);
  
       // Check if we are querying the current values
       if (g_queryInputs)
       {
-        oxrsInput[mcp].queryAll(mcp);
+        g_event_backpressure = true;
+        oxrsInput[mcp]->queryAll(mcp);
+        g_event_backpressure = false;
       }
     }
+
+    // Start publishing events once this MCP has settled
+    if (bitRead(g_mcps_untrusted, mcp) && (millis() - g_mcp_settle_ms[mcp]) >= MCP_SETTLE_MS)
+    {
+      bitClear(g_mcps_untrusted, mcp);
+
+      // Any input changes while it was offline were swallowed while settling
+      // (the handler now matches the pins), so publish the current states
+      if (bitRead(g_mcps_requery, mcp) && oxrsInput[mcp])
+      {
+        g_event_backpressure = true;
+        oxrsInput[mcp]->queryAll(mcp);
+        g_event_backpressure = false;
+      }
+      bitClear(g_mcps_requery, mcp);
+    }
   }
 
   // Ensure we don't keep querying
   g_queryInputs = false;
+
+  // Publish any events raised, in priority order
+  processEventQueues();
+
+  // Then a few of any events we have been asked to replay
+  publishReplayedEvents();
 }